@@ -0,0 +1,47 @@
+#!/bin/sh
+# bench/compare.sh -- Compare benchmark results with a baseline.
+# Copyright (C) 2016 Wolfgang Jaehrling
+#
+# Permission to use, copy, modify, and/or distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+# Usage: bench/compare.sh BASELINE RESULTS [THRESHOLD]
+#
+# Both files are CSV as written by bench/run.bn.  The median times are
+# compared; workloads which got slower by more than THRESHOLD percent
+# (default: 10) are flagged and make the exit status 1.
+
+if [ $# -lt 2 ]; then
+  echo "usage: $0 BASELINE RESULTS [THRESHOLD]" >&2
+  exit 2
+fi
+
+awk -F, -v threshold="${3:-10}" '
+  FNR == 1 { next }  # header
+  NR == FNR { base[$1] = $4; next }
+  {
+    if (!($1 in base)) {
+      printf "%-12s %10s %10d      new\n", $1, "-", $4
+      next
+    }
+    change = base[$1] ? 100 * ($4 - base[$1]) / base[$1] : 0
+    flag = change > threshold ? "  REGRESSION" : ""
+    if (flag) regressions++
+    printf "%-12s %10d %10d %+7.1f%%%s\n", $1, base[$1], $4, change, flag
+  }
+  END {
+    if (regressions) {
+      printf "%d regression(s) above %s%%\n", regressions, threshold
+      exit 1
+    }
+  }
+' "$1" "$2"
@@ -16,8 +16,10 @@
 
 #define _GNU_SOURCE 1 // for mmap()s MAP_ANONYMOUS
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <math.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -25,10 +27,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #ifndef MAP_ANONYMOUS
 #define MAP_ANONYMOUS MAP_ANON
 #endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
 
 #include "bone.h"
 
@@ -182,33 +190,122 @@ my float anynum2float(any x) {
 //////////////// regions ////////////////
 
 #define ALLOC_BLOCKS_AT_ONCE 16
+#define REG_KEEP_BLOCKS 32 // max. blocks a region keeps for reuse after `reg_reset`
 my size_t blocksize;  // in bytes
 my size_t blockwords; // words per block
 my any blockmask; // to get the block an `any` belongs to; is not actually an object!
 my any **free_block;
 // A block begins with a pointer to the previous block that belongs to the region.
 // The metadata of a region (i.e. this struct) is stored in its first block.
-typedef struct reg { any **current_block, **allocp; } *reg;
+// `spare_blocks` are blocks kept by `reg_reset` which will be used before taking new ones.
+// Objects that do not fit into a block are mmap()ed separately and kept in `large`.
+// The counters are for statistics; `blocks` includes the spare ones.
+typedef struct large_obj {
+  struct large_obj *next;
+  size_t size; // including this header
+} *large_obj;
+
+typedef struct reg {
+  any **current_block, **allocp, **spare_blocks;
+  large_obj large;
+  struct reg *children, *next_child; // freed together with this reg, see `reg_new_child()`
+  uint64_t bytes, objects, blocks;
+} *reg;
+
+my bone_mem_stats mem_stats; // FIXME: thread-local
+
+// The allocation profiler takes a sample whenever this runs out.  When
+// profiling is off, it is so big that this will never happen.
+my int64_t alloc_sample_countdown = INT64_MAX; // in bytes
+my void alloc_sample();
 
 // This code is in FORTH-style.
 my any **block(any *x) { return (any **)(blockmask & (any)x); } // get ptr to start of block that x belongs to.
-my any **blocks_alloc(int n) { return mmap(NULL, blocksize * n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0); }
+my any **blocks_alloc(int n) { mem_stats.mmap_calls++; return mmap(NULL, blocksize * n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0); }
 my void block_point_to_next(any **p, int i) { p[i * blockwords] = (any *)&p[(i + 1) * blockwords]; }
 my void blocks_init(any **p, int n) { n--; for(int i = 0; i < n; i++) block_point_to_next(p, i); p[n * blockwords] = NULL; }
-my any **fresh_blocks() { any **p = blocks_alloc(ALLOC_BLOCKS_AT_ONCE); blocks_init(p, ALLOC_BLOCKS_AT_ONCE); return p; }
+my any **fresh_blocks() { any **p = blocks_alloc(ALLOC_BLOCKS_AT_ONCE); blocks_init(p, ALLOC_BLOCKS_AT_ONCE); mem_stats.free_blocks += ALLOC_BLOCKS_AT_ONCE; return p; }
 my void ensure_free_block() { if(!free_block) free_block = fresh_blocks(); }
-my any **block_new(any **next) { ensure_free_block(); any **r = free_block; free_block = (any **)r[0]; r[0] = (any *)next; return r; }
-my void reg_init(reg r, any **b) { r->current_block = b; r->allocp = (any **)&r[1]; }
+my void count_blocks_used(int64_t n) { mem_stats.blocks_in_use += n; mem_stats.free_blocks -= n; }
+my any **block_new(any **next) { ensure_free_block(); any **r = free_block; free_block = (any **)r[0]; r[0] = (any *)next; count_blocks_used(1); return r; }
+my void reg_init(reg r, any **b) {
+  r->current_block = b;
+  r->allocp = (any **)&r[1];
+  r->spare_blocks = NULL;
+  r->large = NULL;
+  r->children = r->next_child = NULL;
+  r->bytes = r->objects = 0;
+  r->blocks = 1;
+}
+my void reg_free_large(reg r) {
+  for(large_obj l = r->large, next; l; l = next) {
+    next = l->next;
+    munmap(l, l->size);
+  }
+  r->large = NULL;
+}
 my reg reg_new() { any **b = block_new(NULL); reg r = (reg)&b[1]; reg_init(r, b); return r; }
-my void reg_free(reg r) { block((any *)r)[0] = (any *)free_block; free_block = r->current_block; }
+// A reg that can be reset on its own, but does not outlive `parent`.
+my reg reg_new_child(reg parent) { reg r = reg_new(); r->next_child = parent->children; parent->children = r; return r; }
+my void block_free(any **b) { b[0] = (any *)free_block; free_block = b; }
+my void reg_free(reg r);
+my void reg_free_children(reg r) {
+  for(reg c = r->children, next; c; c = next) {
+    next = c->next_child;
+    reg_free(c);
+  }
+  r->children = NULL;
+}
+my void reg_free(reg r) {
+  reg_free_children(r);
+  reg_free_large(r);
+  any **spare = r->spare_blocks;
+  count_blocks_used(-r->blocks);
+  block((any *)r)[0] = (any *)free_block;
+  free_block = r->current_block;
+  while(spare) {
+    any **next = (any **)spare[0];
+    block_free(spare);
+    spare = next;
+  }
+}
+
+// Empty the region `r` (which may not be in use), but keep up to
+// REG_KEEP_BLOCKS of its blocks, so that they are still hot in the
+// cache when we allocate again.
+my void reg_reset(reg r) {
+  any **first = block((any *)r);
+  int used = 0;
+  for(any **b = r->current_block; b != first; b = (any **)b[0])
+    used++;
+  any **b = r->current_block;
+  while(b != first) {
+    any **prev = (any **)b[0];
+    if(used-- > REG_KEEP_BLOCKS) { // the most recent ones go away
+      block_free(b);
+      count_blocks_used(-1);
+      r->blocks--;
+    } else {
+      b[0] = (any *)r->spare_blocks;
+      r->spare_blocks = b;
+    }
+    b = prev;
+  }
+  reg_free_children(r);
+  reg_free_large(r);
+  r->current_block = first;
+  r->allocp = (any **)&r[1];
+  r->bytes = r->objects = 0;
+}
 my void blocks_sysfree(any **b) { if(!b) return; any **next = (any **)b[0]; munmap(b, blocksize); blocks_sysfree(next); }
-my void reg_sysfree(reg r) { blocks_sysfree(r->current_block); }
+my void reg_sysfree(reg r) { reg_free_large(r); blocks_sysfree(r->current_block); }
 
 my reg permanent_reg; // FIXME: thread-local
 my reg *reg_stack;
 my int reg_pos, reg_allocated;
 my any **allocp, **current_block; // from currently used reg.
-my void load_reg(reg r)  { allocp = r->allocp; current_block = r->current_block; }
+my reg current_reg; // for updating the counters
+my void load_reg(reg r)  { allocp = r->allocp; current_block = r->current_block; current_reg = r; }
 my void store_reg(reg r) { r->allocp = allocp; r->current_block = current_block; }
 my void inc_regs() {
   if(reg_pos == reg_allocated) {
@@ -226,25 +323,84 @@ my void reg_permanent() { reg_push(permanent_reg); }
 my void in_reg() { reg_push(reg_new()); }
 my void end_in_reg() { reg_free(reg_pop()); }
 
+void bone_get_mem_stats(bone_mem_stats *stats) {
+  *stats = mem_stats;
+  stats->permanent_bytes = permanent_reg->bytes;
+}
+
 my void rollback_reg_sp(int pos) {
   while(pos != reg_pos)
     reg_free(reg_pop());
 }
 
+my any **reg_next_block(any **prev) {
+  reg r = current_reg;
+  if(!r->spare_blocks) {
+    r->blocks++;
+    return block_new(prev);
+  }
+  any **res = r->spare_blocks;
+  r->spare_blocks = (any **)res[0];
+  res[0] = (any *)prev;
+  return res;
+}
+
+my void *reg_alloc_large(size_t n);
+
 any *reg_alloc(int n) {
+  if((size_t)n >= blockwords / 2) // would not fit into a block, or waste most of one
+    return reg_alloc_large(n * sizeof(any));
+  mem_stats.bytes_allocated += n * sizeof(any);
+  mem_stats.objects_allocated++;
+  current_reg->bytes += n * sizeof(any);
+  current_reg->objects++;
+  if((alloc_sample_countdown -= n * sizeof(any)) < 0)
+    alloc_sample();
+
   any *res = (any *)allocp;
   allocp += n;
   if(block((any *)allocp) == current_block)
     return res; // normal case
-  current_block = block_new(current_block);
-  allocp = (any **)&current_block[1];
-  return reg_alloc(n);
+  current_block = reg_next_block(current_block);
+  res = (any *)&current_block[1];
+  allocp = (any **)res + n;
+  return res;
+}
+
+// Allocate `n` bytes that need not fit into a block; they are freed with the region.
+my void *reg_alloc_large(size_t n) {
+  size_t size = sizeof(struct large_obj) + n;
+  large_obj l = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(l == MAP_FAILED)
+    basic_error("could not allocate %zu bytes", n);
+  mem_stats.mmap_calls++;
+  mem_stats.bytes_allocated += n;
+  mem_stats.objects_allocated++;
+  current_reg->bytes += n;
+  current_reg->objects++;
+  l->size = size;
+  l->next = current_reg->large;
+  current_reg->large = l;
+  return &l[1];
+}
+
+// Allocate as many words as fit into the current block, but at least
+// `min` and at most `max` (which must fit into a fresh block).
+my any *reg_alloc_some(int min, int max, int *got) {
+  int left = (any *)current_block + blockwords - (any *)allocp - 1;
+  *got = (left < min || left > max) ? max : left;
+  return reg_alloc(*got);
 }
 
+// Allocate in the region that was active before the current one.  This
+// allows to build a result directly where `copy_back` would copy it to.
+my void reg_push_outer() { reg_push(reg_stack[reg_pos-1]); }
+
 my any copy(any x);
+my any copy_rec(any x);
 
 my any copy_back(any x) {
-  reg_push(reg_stack[reg_pos-1]);
+  reg_push_outer();
   any y = copy(x);
   reg_pop();
   return y;
@@ -495,9 +651,31 @@ my any str(any chrs) {
 
 my any unstr(any s) { return *(any *)untag_check(s, t_str); }
 
-// FIXME: for short strings only
+my int utf8from_strp(const char **sp);
+my void utf8to_strp(int c, char **sp);
+
+// The length of the UTF-8 sequence at `p` if `utf8_read()` accepts it, else 0.
+my int utf8_valid_len(const unsigned char *p) {
+  int n = *p < 0x80 ? 1 : *p < 0xC0 ? 0 : *p < 0xE0 ? 2 : *p < 0xF0 ? 3 : *p < 0xF8 ? 4 : 0;
+  if(n < 2)
+    return n;
+  int val = *p & (0x7F >> n);
+  for(int i = 1; i < n; i++) {
+    if((p[i] & 0xC0) != 0x80) // also stops at the terminating NUL
+      return 0;
+    val = (val << 6) | (p[i] & 0x3F);
+  }
+  const int min[] = { 0, 0, 0x80, 0x800, 0x10000 };
+  return val >= min[n] && val < 0x10FFFF ? n : 0;
+}
+
+// Strs from C (e.g. env vars and file names) need not be valid UTF-8;
+// invalid bytes become one char each, so they can still be used.
 my any charp2list(const char *p) {
-  return !*p ? NIL : cons(int2any(*p), charp2list(p + 1));
+  listgen lg = listgen_new();
+  while(*p)
+    listgen_add(&lg, int2any(utf8_valid_len((const unsigned char *)p) ? utf8from_strp(&p) : (unsigned char)*p++));
+  return lg.xs;
 }
 
 any charp2str(const char *p) { return str(charp2list(p)); }
@@ -506,10 +684,8 @@ my char *list2charp(any x) {
   char *res = malloc(len(x)*4 + 1); // maximum length for UTF-8
   char *p = res;
   try {
-    foreach(c, x) {
-      *p = any2int(c);
-      p++;
-    }
+    foreach(c, x)
+      utf8to_strp(any2int(c), &p);
   } catch {
     free(res);
     throw();
@@ -531,6 +707,20 @@ my bool str_eql(any s1, any s2) {
   return is_nil(s2);
 }
 
+// Compare two strs by their char codes: negative if `s1` comes first.
+my int str_cmp(any s1, any s2) {
+  s1 = unstr(s1);
+  s2 = unstr(s2);
+  foreach(chr, s1) {
+    if(is_nil(s2))
+      return 1;
+    if(chr != far(s2))
+      return any2int(chr) < any2int(far(s2)) ? -1 : 1;
+    s2 = fdr(s2);
+  }
+  return is_nil(s2) ? 0 : -1;
+}
+
 my any num2str(any n) {
   char buf[32];
   switch (get_num_type(n)) {
@@ -657,13 +847,10 @@ my void hash_print(hash h) { // useful for debugging
 
 my bool is_sym(any x) { return is_tagged(x, t_sym); }
 my hash sym_ht;
-my any string_hash(const char *s, size_t *len) { // This is the djb2 algorithm.
+my any string_hash(const char *s, size_t len) { // This is the djb2 algorithm.
   int32_t hash = 5381;
-  *len = 0;
-  while(*s) {
-    (*len)++;
+  while(len--)
     hash = ((hash << 5) + hash) + *(s++);
-  }
   return int2any(hash);
 }
 char *symtext(any sym) { return (char *)untag_check(sym, t_sym); }
@@ -675,26 +862,29 @@ my any as_sym(char *name) {
 
 my any add_sym(const char *name, size_t len, any id) {
   reg_permanent();
-  char *new = (char *)reg_alloc(bytes2words(len + 1));
+  char *new = bytes2words(len + 1) < blockwords / 2 ? (char *)reg_alloc(bytes2words(len + 1)) : reg_alloc_large(len + 1);
   reg_pop();
-  memcpy(new, name, len + 1);
+  memcpy(new, name, len);
+  new[len] = '\0';
   hash_set(sym_ht, id, (any) new);
   return as_sym(new);
 }
 
-any intern(const char *name) {
-  size_t len;
-  any id = string_hash(name, &len);
+// `name` does not need to be terminated; nothing is allocated if the sym exists.
+any intern_n(const char *name, size_t len) {
+  any id = string_hash(name, len);
   while(1) {
     char *candidate = (char *)hash_get(sym_ht, id);
     if(candidate == NULL)
       return add_sym(name, len, id);
-    if(!strcmp(candidate, name))
+    if(!strncmp(candidate, name, len) && candidate[len] == '\0')
       return as_sym(candidate);
     id++;
   }
 }
 
+any intern(const char *name) { return intern_n(name, strlen(name)); }
+
 my any intern_from_chars(any chrs) {
   char *s = list2charp(chrs);
   any res = intern(s);
@@ -714,12 +904,12 @@ my any gensym() {
 my any sym2str(any sym) { return charp2str(symtext(sym)); }
 
 my any s_quote, s_quasiquote, s_unquote, s_unquote_splicing, s_lambda, s_with,
-    s_if, s_list, s_cat, s_dot, s_do, s_arg, s_env;
+    s_if, s_list, s_cat, s_dot, s_do, s_arg, s_env, s_null, s_empty_object;
 #define x(name) s_##name = intern(#name)
 my void init_syms() {
   x(quote); x(quasiquote); x(unquote); s_unquote_splicing = intern("unquote-splicing");
   x(lambda); x(with); x(if); x(do); x(list); x(cat); s_dot = intern(".");
-  x(arg); x(env);
+  x(arg); x(env); x(null); s_empty_object = intern("empty-object");
 }
 #undef x
 
@@ -731,6 +921,9 @@ typedef struct sub_code { // fields are in the order in which we access them.
   int extra_localc;       // the ones introduced by `with`
   any name;               // sym for backtraces
   int size_of_env;        // so that we can copy subs
+  int active;             // activations on the call stack (while counting calls)
+  bool traced;            // selected by `trace-subs`?
+  uint64_t calls, incl_ns, excl_ns; // only counted by `with-call-profiling`
   any ops[1];             // can be longer
 } *sub_code;
 
@@ -743,6 +936,7 @@ my void ensure_sub_alloc(size_t size) {
     int blocks = ALLOC_BLOCKS_AT_ONCE + additional_blocks;
     sub_allocp = (char*)blocks_alloc(blocks);
     sub_alloc_left = blocks * blocksize;
+    mem_stats.sub_arena_bytes += sub_alloc_left;
   }
 }
 
@@ -752,6 +946,7 @@ my sub_code sub_alloc(size_t codeword_cnt) {
   sub_code res = (sub_code)sub_allocp;
   sub_allocp += size;
   sub_alloc_left -= size;
+  mem_stats.sub_code_bytes += size;
   return res;
 }
 
@@ -762,6 +957,9 @@ my sub_code make_sub_code(int argc, int take_rest, int extra_localc, int size_of
   code->extra_localc = extra_localc;
   code->size_of_env = size_of_env;
   code->name = BFALSE;
+  code->active = 0;
+  code->traced = false;
+  code->calls = code->incl_ns = code->excl_ns = 0;
   return code;
 }
 
@@ -785,7 +983,7 @@ my any copy_sub(any x) {
   any res = tag((any)p, t_sub);
   *p++ = (any)s->code;
   for(int i = 0; i != envsize; i++)
-    *p++ = s->env[i] == x ? res : copy(s->env[i]); // allow recursive subs
+    *p++ = s->env[i] == x ? res : copy_rec(s->env[i]); // allow recursive subs
   return res;
 }
 
@@ -982,34 +1180,162 @@ my void utf8putc(int c, FILE *fp) {
 
 //////////////// srcs and dsts ////////////////
 
+typedef struct stream {
+  FILE *fp;
+  // srcs: unread input is between `pos` and `end`.
+  // dsts: output not yet written to `fp` is between `buf` and `pos`; `end` is the end of the buffer.
+  unsigned char *buf, *pos, *end;
+  bool whole_lines; // when reading from a terminal or pipe, don't wait for more than a line
+  bool complete; // srcs: the whole input is in the buffer, so `end` is EOF
+  bool mapped; // a regular file mmap()ed as a whole
+  bool line_buffered; // dsts on terminals are flushed after each line
+  int line;
+  unsigned gen; // str dsts: bumped when finished, as the struct is reused
+  struct stream *next_dst; // all open dsts are kept in a list, so they can be flushed
+} *stream;
+
+// The `stream` is malloc()ed, so that copies of an `io` share the
+// read position and line count, no matter in which reg they are.
+// Srcs reading from memory live in a reg instead, so copying one
+// copies its unread input.  The structs of str dsts are never freed,
+// but reused; `gen` tells whether this `io` refers to the current use.
 typedef struct io {
   type_other_tag t;
-  FILE *fp;
+  unsigned gen;
+  stream s;
   any name;
-  int line;
 } *io;
 
-my any fp2any(FILE *fp, type_other_tag t, any name) {
+#define SRC_BUFSIZE (64 * 1024)
+#define DST_BUFSIZE (64 * 1024)
+
+my stream dsts;
+
+// Map a regular file to memory, so the reader can tokenize directly from it.
+my bool src_map(stream s, struct stat *st) {
+  if(!S_ISREG(st->st_mode) || st->st_size == 0 || (uint64_t)st->st_size > SIZE_MAX)
+    return false;
+  void *p = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fileno(s->fp), 0);
+  if(p == MAP_FAILED)
+    return false;
+  madvise(p, st->st_size, MADV_SEQUENTIAL);
+  s->buf = s->pos = p;
+  s->end = s->buf + st->st_size;
+  s->mapped = s->complete = true;
+  return true;
+}
+
+my stream stream_new(FILE *fp, bool is_src) {
+  stream s = malloc(sizeof(*s));
+  s->fp = fp;
+  s->buf = s->pos = s->end = NULL;
+  s->mapped = s->complete = false;
+  struct stat st;
+  bool stat_ok = fstat(fileno(fp), &st) == 0;
+  s->whole_lines = !stat_ok || !S_ISREG(st.st_mode);
+  s->line_buffered = isatty(fileno(fp));
+  if(is_src) {
+    if(!(stat_ok && ftell(fp) == 0 && src_map(s, &st)))
+      s->buf = s->pos = s->end = malloc(SRC_BUFSIZE);
+  } else {
+    if(fp != stderr) { // stderr stays unbuffered, so errors are never lost
+      s->buf = s->pos = malloc(DST_BUFSIZE);
+      s->end = s->buf + DST_BUFSIZE;
+    }
+    s->next_dst = dsts;
+    dsts = s;
+  }
+  s->line = 1;
+  s->gen = 0;
+  return s;
+}
+
+// Make room in the buffer by writing it out; str dsts grow instead.
+my void dst_drain(stream s) {
+  if(!s->fp) {
+    size_t used = s->pos - s->buf, size = 2 * (s->end - s->buf);
+    s->buf = realloc(s->buf, size);
+    s->pos = s->buf + used;
+    s->end = s->buf + size;
+    return;
+  }
+  if(s->pos != s->buf) {
+    fwrite(s->buf, 1, s->pos - s->buf, s->fp);
+    s->pos = s->buf;
+  }
+}
+
+my void dst_flush(stream s) {
+  dst_drain(s);
+  fflush(s->fp);
+}
+
+// Needs to be done before `fork()` and `exec()`; also done at exit.
+void bone_flush_dsts() {
+  for(stream s = dsts; s; s = s->next_dst)
+    dst_flush(s);
+}
+
+my void flush_line_buffered_dsts() {
+  for(stream s = dsts; s; s = s->next_dst)
+    if(s->line_buffered)
+      dst_flush(s);
+}
+
+my bool stream_close(stream s, any x) {
+  if(!s->fp)
+    generic_error("not a file", x);
+  for(stream *p = &dsts; *p; p = &(*p)->next_dst)
+    if(*p == s) {
+      dst_drain(s);
+      *p = s->next_dst;
+      break;
+    }
+  bool res = fclose(s->fp) == 0;
+  if(s->mapped)
+    munmap(s->buf, s->end - s->buf);
+  else
+    free(s->buf);
+  free(s);
+  return res;
+}
+
+my any stream2any(stream s, type_other_tag t, any name) {
   io res = (io)reg_alloc(bytes2words(sizeof(*res)));
   res->t = t;
-  res->fp = fp;
+  res->gen = s->gen;
+  res->s = s;
   res->name = name;
-  res->line = 1;
   return tag((any)res, t_other);
 }
 
-any fp2src(FILE *fp, any name) { return fp2any(fp, t_other_src, name); }
-any fp2dst(FILE *fp, any name) { return fp2any(fp, t_other_dst, name); }
+any fp2src(FILE *fp, any name) { return stream2any(stream_new(fp, true), t_other_src, name); }
+any fp2dst(FILE *fp, any name) { return stream2any(stream_new(fp, false), t_other_dst, name); }
 
-my FILE *any2fp(any x, type_other_tag t) {
+my stream any2stream(any x, type_other_tag t) {
   io obj = (io)untag_check(x, t_other);
   if(obj->t != t)
     generic_error("can't perform I/O on", x); // FIXME: better error
-  return obj->fp;
+  if(obj->gen != obj->s->gen)
+    generic_error("str dst already finished", x);
+  return obj->s;
+}
+
+my FILE *stream2fp(stream s, any x) {
+  if(!s->fp)
+    generic_error("not a file", x);
+  return s->fp;
 }
 
-FILE *src2fp(any x) { return any2fp(x, t_other_src); }
-FILE *dst2fp(any x) { return any2fp(x, t_other_dst); }
+FILE *src2fp(any x) { return stream2fp(any2stream(x, t_other_src), x); }
+FILE *dst2fp(any x) { // can be written to directly, so we write out our buffer first
+  stream s = any2stream(x, t_other_dst);
+  FILE *fp = stream2fp(s, x);
+  dst_drain(s);
+  return fp;
+}
+bool bone_src_close(any x) { return stream_close(any2stream(x, t_other_src), x); }
+bool bone_dst_close(any x) { return stream_close(any2stream(x, t_other_dst), x); }
 
 my any get_filename(any x) {
   io obj = (io)untag_check(x, t_other);
@@ -1018,216 +1344,1428 @@ my any get_filename(any x) {
   return obj->name;
 }
 
-my any input_line(any x) {
-  io obj = (io)untag_check(x, t_other);
-  if(obj->t != t_other_src)
-    generic_error("expected src", x); // FIXME: better error
-  return obj->line;
-}
+my int input_line(any x) { return any2stream(x, t_other_src)->line; }
 
 my any copy_src(any x) {
-  io res = (io)reg_alloc(bytes2words(sizeof(*res)));
-  res->t = t_other_src;
-  res->fp = src2fp(x);
-  res->name = get_filename(x);
-  res->line = input_line(x);
-  return tag((any)res, t_other);
+  stream s = any2stream(x, t_other_src);
+  if(!s->fp) { // in memory, so it must not stay in the reg of `x`
+    stream c = (stream)reg_alloc(bytes2words(sizeof(*c)));
+    *c = *s;
+    size_t n = s->end - s->pos;
+    c->buf = c->pos = (unsigned char *)reg_alloc(bytes2words(n + 1));
+    memcpy(c->buf, s->pos, n);
+    c->end = c->buf + n;
+    s = c;
+  }
+  return stream2any(s, t_other_src, copy_rec(get_filename(x)));
 }
 
 my any copy_dst(any x) {
-  return fp2dst(dst2fp(x), copy(get_filename(x)));
+  return stream2any(any2stream(x, t_other_dst), t_other_dst, copy_rec(get_filename(x)));
 }
 
 my int dyn_src, dyn_dst;
 
-my void bputc(int x) {
-  utf8putc(x, dst2fp(dynamic_vals[dyn_dst]));
+my stream cur_dst() { return any2stream(dynamic_vals[dyn_dst], t_other_dst); }
+
+my void dst_write(stream s, const char *p, size_t n) {
+  while((size_t)(s->end - s->pos) < n) {
+    if(s->fp && s->pos == s->buf) { // too big for the buffer
+      fwrite(p, 1, n, s->fp);
+      return;
+    }
+    dst_drain(s);
+  }
+  memcpy(s->pos, p, n);
+  s->pos += n;
+}
+
+// The slow path of `dst_putc()`: non-ASCII chars, newlines and a full buffer.
+my void dst_putc_slow(stream s, int c) {
+  char utf8[4], *p = utf8;
+  utf8to_strp(c, &p);
+  dst_write(s, utf8, p - utf8);
+  if(c == '\n' && s->line_buffered)
+    dst_flush(s);
 }
 
+my inline void dst_putc(stream s, int c) {
+  if(c < 0x80 && c != '\n' && s->pos != s->end)
+    *s->pos++ = c;
+  else
+    dst_putc_slow(s, c);
+}
+
+my void bputc(int x) { dst_putc(cur_dst(), x); }
+
 my void bprintf(const char *fmt, ...) {
+  stream s = cur_dst();
   va_list args;
+  while(1) {
+    size_t room = s->end - s->pos;
+    va_start(args, fmt);
+    int n = vsnprintf((char *)s->pos, room, fmt, args); // fine for unbuffered dsts, as `room` is 0
+    va_end(args);
+    if(n < 0)
+      return;
+    if((size_t)n < room) {
+      s->pos += n;
+      return;
+    }
+    if(s->fp && s->pos == s->buf) // too big for the buffer
+      break;
+    dst_drain(s);
+  }
   va_start(args, fmt);
-  vfprintf(dst2fp(dynamic_vals[dyn_dst]), fmt, args);
+  vfprintf(s->fp, fmt, args);
   va_end(args);
 }
 
-my int nextc() {
-  io obj = (io)untag(dynamic_vals[dyn_src]);
-  int res = utf8getc(src2fp(dynamic_vals[dyn_src]));
-  if(res == '\n')
-    obj->line++;
-  return res;
+my void bprint_int(int64_t n) {
+  char digits[24], *p = digits + sizeof(digits);
+  uint64_t u = n < 0 ? -(uint64_t)n : (uint64_t)n;
+  do
+    *--p = '0' + u % 10;
+  while(u /= 10);
+  if(n < 0)
+    *--p = '-';
+  dst_write(cur_dst(), p, digits + sizeof(digits) - p);
+}
+
+// Make sure that at least `n` bytes of unread input are in the
+// buffer, unless we hit EOF first.
+my bool src_fill(stream s, size_t n) {
+  if((size_t)(s->end - s->pos) >= n)
+    return true;
+  if(s->complete)
+    return false;
+  size_t have = s->end - s->pos;
+  memmove(s->buf, s->pos, have);
+  s->pos = s->buf;
+  s->end = s->buf + have;
+  unsigned char *limit = s->buf + SRC_BUFSIZE;
+  while((size_t)(s->end - s->pos) < n && s->end != limit) {
+    if(s->whole_lines) {
+      flush_line_buffered_dsts(); // e.g. the prompt of the REPL
+      int c = getc(s->fp);
+      if(c == EOF)
+        break;
+      *s->end++ = c;
+      while(c != '\n' && s->end != limit && (c = getc(s->fp)) != EOF)
+        *s->end++ = c;
+    } else {
+      size_t got = fread(s->end, 1, limit - s->end, s->fp);
+      if(got == 0)
+        break;
+      s->end += got;
+    }
+  }
+  return (size_t)(s->end - s->pos) >= n;
 }
 
-my int look() {
-  FILE *fp = src2fp(dynamic_vals[dyn_src]);
-  int res = fgetc(fp);
-  ungetc(res, fp); // FIXME: only works for ASCIIs
+my int src_byte(stream s) { return s->pos != s->end ? *s->pos++ : EOF; }
+
+my size_t utf8_len(int lead) { return lead < 0xC0 ? 1 : lead < 0xE0 ? 2 : lead < 0xF0 ? 3 : 4; }
+
+// The slow path of `nextc()`: refill the buffer and decode non-ASCII chars.
+my int src_getc(stream s) {
+  if(!src_fill(s, 1))
+    return EOF;
+  src_fill(s, utf8_len(*s->pos)); // if this fails, `utf8_read()` complains
+  int res = utf8_read((utf8_reader)src_byte, s);
+  if(res == '\n')
+    s->line++;
   return res;
 }
 
-//////////////// printer ////////////////
+my stream cur_src() { return ((io)untag(dynamic_vals[dyn_src]))->s; }
 
-my void print(any x);
+my inline int nextc() {
+  stream s = cur_src();
+  if(s->pos != s->end && *s->pos < 0x80 && *s->pos != '\n')
+    return *s->pos++;
+  return src_getc(s);
+}
 
-my void print_sub_args(any x) {
-  if(!is_cons(x)) {
-    if(!is_nil(x)) {
-      bprintf(". ");
-      print(x);
-      bputc(' ');
-    }
-    return;
+my inline int look() {
+  stream s = cur_src();
+  if(s->pos != s->end && *s->pos < 0x80)
+    return *s->pos;
+  if(!src_fill(s, 1))
+    return EOF;
+  src_fill(s, utf8_len(*s->pos));
+  unsigned char *pos = s->pos;
+  int res = utf8_read((utf8_reader)src_byte, s);
+  s->pos = pos;
+  return res;
+}
+
+my size_t utf8_size(int c) { return c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4; }
+
+// A src reading from the str `x`; everything is allocated in the current reg.
+any str2src(any x) {
+  size_t n = 0;
+  foreach(c, unstr(x))
+    n += utf8_size(any2int(c));
+  stream s = (stream)reg_alloc(bytes2words(sizeof(*s)));
+  s->fp = NULL;
+  s->buf = s->pos = (unsigned char *)reg_alloc(bytes2words(n + 1));
+  char *p = (char *)s->buf;
+  foreach(c, unstr(x))
+    utf8to_strp(any2int(c), &p);
+  s->end = (unsigned char *)p;
+  s->whole_lines = s->mapped = s->line_buffered = false;
+  s->complete = true;
+  s->line = 1;
+  s->gen = 0;
+  return stream2any(s, t_other_src, BFALSE);
+}
+
+my stream finished_str_dsts; // linked via `next_dst`, for reuse
+
+// A dst collecting output in memory; use `str_dst_finish()` to get it as a str.
+my any str_dst() {
+  stream s = finished_str_dsts;
+  if(s)
+    finished_str_dsts = s->next_dst;
+  else {
+    s = malloc(sizeof(*s));
+    s->gen = 0;
   }
-  print(far(x));
-  bputc(' ');
-  print_sub_args(fdr(x));
+  s->fp = NULL;
+  s->buf = s->pos = malloc(256);
+  s->end = s->buf + 256;
+  s->whole_lines = s->mapped = s->complete = s->line_buffered = false;
+  s->line = 1;
+  return stream2any(s, t_other_dst, BFALSE);
 }
 
-my bool is_arglist(any x) {
-  if(is_nil(x) || is_sym(x))
-    return true;
-  if(is_cons(x) && is_sym(far(x)) && is_arglist(fdr(x)))
-    return true;
-  return false;
+// Copies of the dst may live on, so `any2stream()` must see that it is finished.
+my void str_dst_free(stream s) {
+  free(s->buf);
+  s->gen++;
+  s->next_dst = finished_str_dsts;
+  finished_str_dsts = s;
 }
 
-my void print(any x) {
-  switch (tag_of(x)) {
-  case t_cons: {
-    any a = far(x);
-    if(is_sym(a)) {
-      if(a == s_quote)            { bputc('\'');   print(fdr(x)); break; }
-      if(a == s_unquote)          { bputc(',');    print(fdr(x)); break; }
-      if(a == s_unquote_splicing) { bprintf(",@"); print(fdr(x)); break; }
-      if(a == s_quasiquote && is_cons(fdr(x)) && is_nil(fdr(fdr(x)))) {
-        bputc('`');
-        print(far(fdr(x)));
-        break;
-      }
-      if(a == s_lambda  && is_cons(fdr(x)) && is_arglist(far(fdr(x))) && is_single(fdr(fdr(x))) && is_cons(far(fdr(fdr(x))))) {
-        bprintf("| ");
-        print_sub_args(far(fdr(x)));
-        print(far(fdr(fdr(x))));
-        break;
+my any str_dst_finish(any dst) {
+  stream s = any2stream(dst, t_other_dst);
+  listgen lg = listgen_new();
+  const char *p = (char *)s->buf;
+  while(p != (char *)s->pos)
+    listgen_add(&lg, int2any(utf8from_strp(&p)));
+  str_dst_free(s);
+  return str(lg.xs);
+}
+
+// Read the rest of the current line (without the newline), or return
+// ENDOFFILE if there is nothing left.  Instead of consing up the str
+// char by char, we count the chars up to the newline in the buffer
+// and allocate the conses for them in bulk.
+my any read_line() {
+  stream s = cur_src();
+  if(!src_fill(s, 1))
+    return ENDOFFILE;
+  any res = NIL, *tail = &res;
+  while(src_fill(s, 1)) {
+    unsigned char *nl = memchr(s->pos, '\n', s->end - s->pos), *limit = nl ? nl : s->end;
+    if(!nl && !s->complete) // don't split a char at the end of the buffer
+      for(unsigned char *p = limit; p != s->pos && p != limit - 4; p--)
+        if(p[-1] >= 0xC0) {
+          if(p - 1 + utf8_len(p[-1]) > limit)
+            limit = p - 1;
+          break;
+        }
+    int chars = 0;
+    for(unsigned char *p = s->pos; p != limit; p++)
+      chars += (*p & 0xC0) != 0x80;
+    while(chars) {
+      int n, most = ((int)blockwords - 2) & ~1;
+      any *cells = reg_alloc_some(2, 2 * chars < most ? 2 * chars : most, &n);
+      n /= 2;
+      for(int i = 0; i < n; i++) {
+        cells[2 * i] = int2any(*s->pos < 0x80 ? *s->pos++ : utf8_read((utf8_reader)src_byte, s));
+        cells[2 * i + 1] = (any)&cells[2 * i + 2];
       }
+      cells[2 * n - 1] = NIL;
+      *tail = (any)cells;
+      tail = &cells[2 * n - 1];
+      chars -= n;
     }
-    bool first = true;
-    bputc('(');
-    do {
-      if(first)
-        first = false;
-      else
-        bputc(' ');
-      print(far(x));
-      x = fdr(x);
-    } while(is_tagged(x, t_cons));
-    if(x != NIL) {
-      bprintf(" . ");
-      print(x);
-    }
-    bputc(')');
-    break;
-  }
-  case t_sym: bprintf("%s", symtext(x)); break;
-  case t_num:
-    switch (get_num_type(x)) {
-    case t_num_int: bprintf("%" PRId64, any2int(x)); break;
-    case t_num_float: bprintf("%g", (double)any2float(x)); break;
-    default: abort();
-    }
-    break;
-  case t_uniq:
-    switch (x) {
-    case NIL: bprintf("()"); break;
-    case BTRUE: bprintf("#t"); break;
-    case BFALSE: bprintf("#f"); break;
-    case ENDOFFILE: bprintf("#{eof}"); break;
-    default:
-      bprintf("#{?}");
-    }
-    break;
-  case t_str:
-    bputc('"');
-    foreach(c, unstr(x))
-      switch (any2int(c)) {
-      case '"': bprintf("\\\""); break;
-      case '\\': bprintf("\\\\"); break;
-      case '\n': bprintf("\\n"); break;
-      case '\t': bprintf("\\t"); break;
-      default:
-        bputc(any2int(c));
-      }
-    bputc('"');
-    break;
-  case t_sub:
-    bprintf("#sub(id=%p name=", (void *)x);
-    sub_code code = any2sub(x)->code;
-    print(code->name);
-    bprintf(" argc=%d take-rest?=", code->argc);
-    print(code->take_rest ? BTRUE : BFALSE);
-    bputc(')');
-    break;
-  case t_other:
-    switch(get_other_type(x)) {
-    case t_other_src:
-      bprintf("#{src ");
-      print(get_filename(x));
-      bprintf(":%d}", input_line(x));
+    if(nl) {
+      s->pos++;
+      s->line++;
       break;
-    case t_other_dst:
-      bprintf("#{dst ");
-      print(get_filename(x));
-      bputc('}');
-      break;
-    default:
-      abort();
     }
-    break;
-  default:
-    abort();
+    if(s->pos != s->end) { // a char that is not completely in the buffer yet
+      *tail = single(int2any(src_getc(s)));
+      tail = &((any *)*tail)[1];
+    }
   }
+  return str(res);
 }
 
-my void say_str(any s) {
-  foreach(chr, unstr(s))
-    bputc(any2int(chr));
-}
+//////////////// bytes ////////////////
 
-my void say(any x) {
-  switch (tag_of(x)) {
-  case t_str:
-    say_str(x);
-    break;
-  case t_cons:
-    foreach(e, x)
-      say(e);
-    break;
-  default:
-    print(x);
-  }
+typedef struct bytes {
+  type_other_tag t;
+  size_t len;
+  unsigned char *data; // may point into the data of other bytes (for slices)
+} *bytes;
+
+my any bytes_new(size_t len) {
+  bytes res = (bytes)reg_alloc(bytes2words(sizeof(*res)));
+  res->t = t_other_bytes;
+  res->len = len;
+  if(len == 0)
+    res->data = NULL;
+  else if(bytes2words(len) < blockwords / 2)
+    res->data = (unsigned char *)reg_alloc(bytes2words(len));
+  else
+    res->data = reg_alloc_large(len);
+  return tag((any)res, t_other);
 }
 
-my void eprint(any x) {
-  if(!silence_errors) {
-    any old = dynamic_vals[dyn_dst];
-    dynamic_vals[dyn_dst] = get_dyn_val(intern("*stderr*"));
-    print(x);
-    dynamic_vals[dyn_dst] = old;
-  }
+my bytes any2bytes(any x) {
+  bytes b = (bytes)untag_check(x, t_other);
+  if(b->t != t_other_bytes)
+    generic_error("expected bytes", x);
+  return b;
 }
 
-//////////////// reader ////////////////
+my any copy_bytes(any x) {
+  bytes b = any2bytes(x);
+  any res = bytes_new(b->len);
+  if(b->len)
+    memcpy(any2bytes(res)->data, b->data, b->len);
+  return res;
+}
 
-my void parse_error(const char *text) {
-  eprint(dynamic_vals[dyn_src]);
-  eprintf(": parse error: %s\n", text);
-  throw();
-} 
+my any bytes_slice(any x, int64_t start, int64_t end) {
+  bytes b = any2bytes(x);
+  if(start < 0 || start > end || (uint64_t)end > b->len)
+    basic_error("invalid slice from %" PRId64 " to %" PRId64 " of %zu bytes", start, end, b->len);
+  bytes res = (bytes)reg_alloc(bytes2words(sizeof(*res)));
+  res->t = t_other_bytes;
+  res->len = end - start;
+  res->data = b->data + start;
+  return tag((any)res, t_other);
+}
 
-// These can be used for syms in s-exprs
-// Disallowed are the first 32 and "#'(),@:;[]`{}|
-my bool allowed_chars[] = {
+// Read up to `n` raw bytes from the current src; whole buffers are
+// copied, and big reads go directly into the result.
+my any read_bytes(size_t n) {
+  stream s = cur_src();
+  any res = bytes_new(n);
+  bytes b = any2bytes(res);
+  size_t got = 0;
+  while(got != n) {
+    if(s->pos == s->end) {
+      if(s->complete)
+        break;
+      if(n - got >= SRC_BUFSIZE && s->fp) {
+        size_t k = fread(b->data + got, 1, n - got, s->fp);
+        if(k == 0)
+          break;
+        got += k;
+        continue;
+      }
+      if(!src_fill(s, 1))
+        break;
+    }
+    size_t k = s->end - s->pos;
+    if(k > n - got)
+      k = n - got;
+    memcpy(b->data + got, s->pos, k);
+    s->pos += k;
+    got += k;
+  }
+  for(unsigned char *p = b->data, *end = p + got; p && (p = memchr(p, '\n', end - p)); p++)
+    s->line++;
+  if(got == 0 && n != 0)
+    return ENDOFFILE;
+  b->len = got;
+  return res;
+}
+
+my void write_bytes(any x) {
+  bytes b = any2bytes(x);
+  dst_write(cur_dst(), (char *)b->data, b->len);
+}
+
+// The integer types for `bytes-pack` and `bytes-unpack`.
+my struct {
+  const char *name;
+  int size;
+  bool big_endian;
+} int_types[] = {
+  { "u8", 1, false },
+  { "u16le", 2, false }, { "u16be", 2, true },
+  { "u32le", 4, false }, { "u32be", 4, true },
+  { "u64le", 8, false }, { "u64be", 8, true }
+};
+
+my int int_type_size(any type, bool *big_endian) {
+  const char *name = symtext(type);
+  for(size_t i = 0; i != sizeof(int_types) / sizeof(int_types[0]); i++)
+    if(!strcmp(name, int_types[i].name)) {
+      *big_endian = int_types[i].big_endian;
+      return int_types[i].size;
+    }
+  generic_error("unknown integer type", type);
+  return 0;
+}
+
+my size_t int_types_size(any types) {
+  size_t res = 0;
+  bool be;
+  foreach(type, types)
+    res += int_type_size(type, &be);
+  return res;
+}
+
+my any bytes_pack(any types, any nums) {
+  any res = bytes_new(int_types_size(types));
+  unsigned char *p = any2bytes(res)->data;
+  foreach(type, types) {
+    if(!is_cons(nums))
+      basic_error("bytes-pack: fewer nums than types");
+    bool be;
+    int size = int_type_size(type, &be);
+    int64_t n = any2int(far(nums));
+    if(n < 0 || (size < 8 && n >> (8 * size)))
+      generic_error("does not fit into that type", far(nums));
+    for(int i = 0; i < size; i++)
+      p[be ? size - 1 - i : i] = n >> (8 * i);
+    p += size;
+    nums = fdr(nums);
+  }
+  return res;
+}
+
+my any bytes_unpack(any types, any x, int64_t offset) {
+  bytes b = any2bytes(x);
+  if(offset < 0 || (uint64_t)offset + int_types_size(types) > b->len)
+    basic_error("bytes-unpack: not enough bytes");
+  unsigned char *p = b->data + offset;
+  listgen lg = listgen_new();
+  foreach(type, types) {
+    bool be;
+    int size = int_type_size(type, &be);
+    uint64_t n = 0;
+    for(int i = 0; i < size; i++)
+      n |= (uint64_t)p[be ? size - 1 - i : i] << (8 * i);
+    if(n > BONE_INT_MAX)
+      basic_error("bytes-unpack: %" PRIu64 " does not fit into a num", n);
+    listgen_add(&lg, int2any(n));
+    p += size;
+  }
+  return lg.xs;
+}
+
+// A src reading the raw bytes in `x`; like `str2src()`, but without copying.
+my any bytes2src(any x) {
+  bytes b = any2bytes(x);
+  stream s = (stream)reg_alloc(bytes2words(sizeof(*s)));
+  s->fp = NULL;
+  s->buf = s->pos = b->data;
+  s->end = b->data + b->len;
+  s->whole_lines = s->mapped = s->line_buffered = false;
+  s->complete = true;
+  s->line = 1;
+  s->gen = 0;
+  return stream2any(s, t_other_src, BFALSE);
+}
+
+// Like `str_dst_finish()`, but returns the raw bytes.
+my any bytes_dst_finish(any dst) {
+  stream s = any2stream(dst, t_other_dst);
+  any res = bytes_new(s->pos - s->buf);
+  if(s->pos != s->buf)
+    memcpy(any2bytes(res)->data, s->buf, s->pos - s->buf);
+  str_dst_free(s);
+  return res;
+}
+
+// We decode via a src, so invalid UTF-8 is reported as usual.
+my any utf8_bytes2str(const unsigned char *p, size_t n) {
+  struct stream s = { .buf = (unsigned char *)p, .pos = (unsigned char *)p, .end = (unsigned char *)p + n, .complete = true };
+  listgen lg = listgen_new();
+  while(s.pos != s.end)
+    listgen_add(&lg, int2any(*s.pos < 0x80 ? *s.pos++ : utf8_read((utf8_reader)src_byte, &s)));
+  return str(lg.xs);
+}
+
+//////////////// serialization ////////////////
+
+// Each value starts with one of these tags.  Conses, strs, syms and
+// bytes are numbered in the order they appear; later occurrences of
+// the same object are written as SER_REF with that number, so sharing
+// is preserved.  A cons is followed by its car and its cdr.  Lengths
+// and ints are written as varints (ints zigzag encoded), floats as
+// 4 bytes in little endian.
+enum { SER_NIL, SER_TRUE, SER_FALSE, SER_EOF, SER_INT, SER_FLOAT, SER_SYM, SER_STR, SER_CONS, SER_BYTES, SER_REF };
+
+typedef struct serializer {
+  stream s;
+  hash seen; // object -> number
+  int64_t objects;
+} serializer;
+
+my void ser_byte(serializer *ser, int b) {
+  char c = b;
+  dst_write(ser->s, &c, 1);
+}
+
+my void ser_uint(serializer *ser, uint64_t n) {
+  char buf[10];
+  int i = 0;
+  while(n >= 0x80) {
+    buf[i++] = (n & 0x7f) | 0x80;
+    n >>= 7;
+  }
+  buf[i++] = n;
+  dst_write(ser->s, buf, i);
+}
+
+// Write a reference if we have seen `x` before, otherwise give it a number.
+my bool ser_ref(serializer *ser, any x) {
+  any n = hash_get(ser->seen, x);
+  if(is(n)) {
+    ser_byte(ser, SER_REF);
+    ser_uint(ser, any2int(n));
+    return true;
+  }
+  hash_set(ser->seen, x, int2any(ser->objects++));
+  return false;
+}
+
+my void serialize_rec(serializer *ser, any x) {
+  while(1) { // loop instead of recursion for the cdr, so long lists are fine
+    switch(tag_of(x)) {
+    case t_cons:
+      if(ser_ref(ser, x))
+        return;
+      ser_byte(ser, SER_CONS);
+      serialize_rec(ser, far(x));
+      x = fdr(x);
+      continue;
+    case t_str:
+      if(ser_ref(ser, x))
+        return;
+      ser_byte(ser, SER_STR);
+      ser_uint(ser, len(unstr(x)));
+      foreach(c, unstr(x))
+        dst_putc(ser->s, any2int(c));
+      return;
+    case t_sym: {
+      if(ser_ref(ser, x))
+        return;
+      const char *name = symtext(x);
+      size_t n = strlen(name);
+      ser_byte(ser, SER_SYM);
+      ser_uint(ser, n);
+      dst_write(ser->s, name, n);
+      return;
+    }
+    case t_num:
+      if(get_num_type(x) == t_num_int) {
+        int64_t n = any2int(x);
+        ser_byte(ser, SER_INT);
+        ser_uint(ser, ((uint64_t)n << 1) ^ (uint64_t)(n >> 63));
+      } else {
+        float f = any2float(x);
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        char buf[4] = { bits, bits >> 8, bits >> 16, bits >> 24 };
+        ser_byte(ser, SER_FLOAT);
+        dst_write(ser->s, buf, 4);
+      }
+      return;
+    case t_uniq:
+      switch(x) {
+      case NIL: ser_byte(ser, SER_NIL); return;
+      case BTRUE: ser_byte(ser, SER_TRUE); return;
+      case BFALSE: ser_byte(ser, SER_FALSE); return;
+      case ENDOFFILE: ser_byte(ser, SER_EOF); return;
+      }
+      break;
+    case t_other:
+      if(get_other_type(x) == t_other_bytes) {
+        if(ser_ref(ser, x))
+          return;
+        bytes b = any2bytes(x);
+        ser_byte(ser, SER_BYTES);
+        ser_uint(ser, b->len);
+        dst_write(ser->s, (char *)b->data, b->len);
+        return;
+      }
+      break;
+    default:
+      break;
+    }
+    generic_error("cannot serialize", x);
+  }
+}
+
+my void serialize(any x) {
+  serializer ser = { cur_dst(), hash_new(61, BFALSE), 0 };
+  bool failed = false;
+  try {
+    serialize_rec(&ser, x);
+  } catch {
+    failed = true;
+  }
+  hash_free(ser.seen);
+  if(failed)
+    throw();
+}
+
+typedef struct deserializer {
+  stream s;
+  any *objects; // by number
+  size_t count, size;
+} deserializer;
+
+my int des_byte(deserializer *des) {
+  stream s = des->s;
+  if(s->pos == s->end && !src_fill(s, 1))
+    basic_error("unexpected end of serialized data");
+  return *s->pos++;
+}
+
+my uint64_t des_uint(deserializer *des) {
+  uint64_t n = 0;
+  for(int shift = 0; shift < 64; shift += 7) {
+    int b = des_byte(des);
+    n |= (uint64_t)(b & 0x7f) << shift;
+    if(!(b & 0x80))
+      break;
+  }
+  return n;
+}
+
+my any des_add(deserializer *des, any x) {
+  if(des->count == des->size) {
+    des->size = 2 * des->size + 64;
+    des->objects = realloc(des->objects, des->size * sizeof(any));
+  }
+  des->objects[des->count++] = x;
+  return x;
+}
+
+my any deserialize_atom(deserializer *des, int tag) {
+  stream s = des->s;
+  switch(tag) {
+  case SER_NIL: return NIL;
+  case SER_TRUE: return BTRUE;
+  case SER_FALSE: return BFALSE;
+  case SER_EOF: return ENDOFFILE;
+  case SER_INT: {
+    uint64_t n = des_uint(des);
+    return int2any((int64_t)(n >> 1) ^ -(int64_t)(n & 1));
+  }
+  case SER_FLOAT: {
+    uint32_t bits = 0;
+    for(int i = 0; i < 4; i++)
+      bits |= (uint32_t)des_byte(des) << (8 * i);
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return float2any(f);
+  }
+  case SER_SYM: {
+    uint64_t n = des_uint(des);
+    if(src_fill(s, n)) {
+      any res = intern_n((char *)s->pos, n);
+      s->pos += n;
+      return des_add(des, res);
+    }
+    char *name = malloc(n); // it does not fit into the buffer, so collect it in chunks
+    if(!name)
+      basic_error("unexpected end of serialized data");
+    for(uint64_t got = 0; got != n; ) {
+      if(s->pos == s->end && !src_fill(s, 1)) {
+        free(name);
+        basic_error("unexpected end of serialized data");
+      }
+      size_t chunk = s->end - s->pos;
+      if(chunk > n - got)
+        chunk = n - got;
+      memcpy(name + got, s->pos, chunk);
+      s->pos += chunk;
+      got += chunk;
+    }
+    any res = intern_n(name, n);
+    free(name);
+    return des_add(des, res);
+  }
+  case SER_STR: {
+    uint64_t n = des_uint(des);
+    listgen lg = listgen_new();
+    while(n--) {
+      int c = s->pos != s->end && *s->pos < 0x80 ? *s->pos++ : src_getc(s);
+      if(c == EOF)
+        basic_error("unexpected end of serialized data");
+      listgen_add(&lg, int2any(c));
+    }
+    return des_add(des, str(lg.xs));
+  }
+  case SER_BYTES: {
+    uint64_t n = des_uint(des);
+    any res = n ? read_bytes(n) : bytes_new(0);
+    if(res == ENDOFFILE || any2bytes(res)->len != n)
+      basic_error("unexpected end of serialized data");
+    return des_add(des, res);
+  }
+  case SER_REF: {
+    uint64_t n = des_uint(des);
+    if(n >= des->count)
+      basic_error("invalid reference in serialized data");
+    return des->objects[n];
+  }
+  default:
+    basic_error("invalid tag in serialized data: %d", tag);
+    return BFALSE;
+  }
+}
+
+my any deserialize_rec(deserializer *des) {
+  any res, *tail = &res;
+  while(1) {
+    int tag = des_byte(des);
+    if(tag != SER_CONS) {
+      *tail = deserialize_atom(des, tag);
+      return res;
+    }
+    any c = des_add(des, cons(BFALSE, NIL)); // numbered before its car, like when writing
+    *tail = c;
+    set_far(c, deserialize_rec(des));
+    tail = &((any *)c)[1];
+  }
+}
+
+// Returns ENDOFFILE if there is nothing left in the current src.
+my any deserialize() {
+  deserializer des = { cur_src(), NULL, 0, 0 };
+  if(!src_fill(des.s, 1))
+    return ENDOFFILE;
+  bool failed = false;
+  any res = BFALSE;
+  try {
+    res = deserialize_rec(&des);
+  } catch {
+    failed = true;
+  }
+  free(des.objects);
+  if(failed)
+    throw();
+  return res;
+}
+
+//////////////// equality and hashing ////////////////
+
+// `equal()` and `equal_hash()` walk the cdrs in a loop and keep the
+// cars which are conses on a stack of their own, so neither long lists
+// nor deep trees use up the C stack.
+
+typedef struct walk_stack {
+  any *xs;
+  size_t depth, size;
+} walk_stack;
+
+my void walk_push(walk_stack *ws, any x) {
+  if(ws->depth == ws->size) {
+    ws->size = ws->size ? 2 * ws->size : 32;
+    ws->xs = realloc(ws->xs, ws->size * sizeof(any));
+  }
+  ws->xs[ws->depth++] = x;
+}
+
+my bool is_bytes(any x) { return is_tagged(x, t_other) && get_other_type(x) == t_other_bytes; }
+
+// For anything but conses, which `equal()` handles itself.
+my bool equal_atom(any a, any b) {
+  if(a == b)
+    return true;
+  if(is_str(a))
+    return is_str(b) && str_eql(a, b);
+  if(is_bytes(a) && is_bytes(b)) {
+    bytes x = any2bytes(a), y = any2bytes(b);
+    return x->len == y->len && (x->len == 0 || !memcmp(x->data, y->data, x->len));
+  }
+  return false;
+}
+
+my bool equal(any a, any b) {
+  walk_stack ws = { NULL, 0, 0 };
+  bool res = true;
+  while(res) {
+    while(a != b) {
+      if(!is_cons(a) || !is_cons(b)) {
+        res = equal_atom(a, b);
+        break;
+      }
+      any x = far(a), y = far(b);
+      if(is_cons(x) && is_cons(y) && x != y) {
+        walk_push(&ws, x);
+        walk_push(&ws, y);
+      } else if(!equal_atom(x, y)) {
+        res = false;
+        break;
+      }
+      a = fdr(a);
+      b = fdr(b);
+    }
+    if(ws.depth == 0)
+      break;
+    b = ws.xs[--ws.depth];
+    a = ws.xs[--ws.depth];
+  }
+  free(ws.xs);
+  return res;
+}
+
+my uint64_t hash_mix(uint64_t h, uint64_t x) { return (h ^ x) * 0x100000001b3; } // as in FNV-1a
+
+my uint64_t hash_atom(uint64_t h, any x) {
+  if(is_str(x)) {
+    h = hash_mix(h, t_str);
+    foreach(c, unstr(x))
+      h = hash_mix(h, c);
+    return h;
+  }
+  if(is_bytes(x)) {
+    bytes b = any2bytes(x);
+    h = hash_mix(h, b->len);
+    for(size_t i = 0; i != b->len; i++)
+      h = hash_mix(h, b->data[i]);
+    return h;
+  }
+  return hash_mix(h, x); // syms are unique, nums and uniqs are immediate
+}
+
+// Structures that are `equal()` get the same hash.
+my uint64_t equal_hash(any x) {
+  walk_stack ws = { NULL, 0, 0 };
+  uint64_t h = 0xcbf29ce484222325;
+  while(1) {
+    while(is_cons(x)) {
+      h = hash_mix(h, t_cons);
+      any a = far(x);
+      if(is_cons(a)) {
+        walk_push(&ws, fdr(x));
+        x = a;
+      } else {
+        h = hash_atom(h, a);
+        x = fdr(x);
+      }
+    }
+    h = hash_atom(h, x);
+    if(ws.depth == 0)
+      break;
+    x = ws.xs[--ws.depth];
+  }
+  free(ws.xs);
+  return h;
+}
+
+//////////////// promises ////////////////
+
+// A promise evaluates its thunk at most once and remembers the result.
+// The result is allocated in the region the promise lives in, so that
+// it lives as long as the promise (and no longer).
+typedef struct promise {
+  type_other_tag t;
+  bool forced, forcing;
+  any val; // the thunk until forced
+  reg r;
+} *promise;
+
+my any promise_new(any thunk, bool forced) {
+  promise res = (promise)reg_alloc(bytes2words(sizeof(*res)));
+  res->t = t_other_promise;
+  res->forced = forced;
+  res->forcing = false;
+  res->val = thunk;
+  res->r = current_reg;
+  return tag((any)res, t_other);
+}
+
+my bool is_promise(any x) { return is_tagged(x, t_other) && get_other_type(x) == t_other_promise; }
+
+my promise any2promise(any x) {
+  if(!is_promise(x))
+    generic_error("expected promise", x);
+  return (promise)untag(x);
+}
+
+// An unforced copy is forced on its own: forcing here instead could
+// run away on infinite streams, as the value is copied, too.
+my any copy_promise(any x) {
+  promise p = any2promise(x);
+  return promise_new(copy_rec(p->val), p->forced);
+}
+
+my any force(any x) {
+  if(!is_promise(x))
+    return x;
+  promise p = any2promise(x);
+  if(p->forced)
+    return p->val;
+  if(p->forcing)
+    generic_error("promise depends on its own value", x);
+  p->forcing = true;
+  reg_push(p->r);
+  bool failed = false;
+  try { // so that a `throw` will not free the region of the promise
+    call0(p->val);
+  } catch {
+    failed = true;
+  }
+  reg_pop();
+  p->forcing = false;
+  if(failed)
+    throw();
+  p->forced = true;
+  p->val = last_value;
+  return p->val;
+}
+
+//////////////// memoization ////////////////
+
+// A memo cache maps argument lists to results.  Entries are kept in
+// two generations with at most half the `capacity` each: new entries go
+// to the young one; when it is full, the old one is dropped and the
+// young one becomes the old one.  Hits in the old generation are moved
+// to the young one, so entries in use survive.
+//
+// Each generation is allocated in a region of its own, which is reset
+// when the generation is dropped, so memory use is bounded.  For caches
+// that are not permanent, these are children of the region the cache
+// was created in, so they are gone together with it.
+
+typedef struct memo_gen {
+  reg r;
+  size_t count, mask, moved; // `moved`: entries that were moved to the young generation
+  any *slots; // key, value and hash for each slot; key 0 means free
+} memo_gen;
+
+typedef struct memo {
+  type_other_tag t;
+  bool permanent, by_equal;
+  size_t capacity, gen_capacity;
+  uint64_t hits, misses, evictions;
+  memo_gen young, old;
+} *memo;
+
+my void apply(any s, any xs);
+
+my void memo_gen_init(memo m, memo_gen *g) {
+  size_t slots = 2;
+  while(slots < 2 * m->gen_capacity)
+    slots *= 2;
+  g->count = g->moved = 0;
+  g->mask = slots - 1;
+  size_t words = 3 * slots;
+  reg_push(g->r);
+  if(words < blockwords / 2) {
+    g->slots = (any *)reg_alloc(words);
+    memset(g->slots, 0, words * sizeof(any));
+  } else
+    g->slots = reg_alloc_large(words * sizeof(any)); // zeroed by `mmap()`
+  reg_pop();
+}
+
+my any memo_new(size_t capacity, bool by_equal, bool permanent) {
+  if(permanent)
+    reg_permanent();
+  memo m = (memo)reg_alloc(bytes2words(sizeof(*m)));
+  if(permanent)
+    reg_pop();
+  m->t = t_other_memo;
+  m->permanent = permanent;
+  m->by_equal = by_equal;
+  m->capacity = capacity;
+  m->gen_capacity = (capacity + 1) / 2;
+  m->hits = m->misses = m->evictions = 0;
+  m->young.r = permanent ? reg_new() : reg_new_child(current_reg);
+  m->old.r = permanent ? reg_new() : reg_new_child(current_reg);
+  memo_gen_init(m, &m->young);
+  memo_gen_init(m, &m->old);
+  return tag((any)m, t_other);
+}
+
+my memo any2memo(any x) {
+  memo m = (memo)untag_check(x, t_other);
+  if(m->t != t_other_memo)
+    generic_error("expected memo cache", x);
+  return m;
+}
+
+// Permanent caches stay where they are; others cannot leave their
+// region, so the copy is a new, empty cache.
+my any copy_memo(any x) {
+  memo m = any2memo(x);
+  return m->permanent ? x : memo_new(m->capacity, m->by_equal, false);
+}
+
+my uint64_t memo_hash(memo m, any args) {
+  if(m->by_equal)
+    return equal_hash(args);
+  uint64_t h = 0xcbf29ce484222325;
+  foreach(x, args) {
+    // Anything else may be freed with its region while the cache still
+    // holds it, and a new object at the same address would be a hit.
+    if(!is_num(x) && !is_sym(x) && !is_tagged(x, t_uniq))
+      generic_error("memo cache with eq keys needs nums, syms or uniqs as args, but got", x);
+    h = hash_mix(h, x);
+  }
+  return h;
+}
+
+my bool memo_key_eql(memo m, any key, any args) {
+  if(m->by_equal)
+    return equal(key, args);
+  while(is_cons(key) && is_cons(args)) {
+    if(far(key) != far(args))
+      return false;
+    key = fdr(key);
+    args = fdr(args);
+  }
+  return key == args;
+}
+
+// Keys compared with `eq?` only need their own list; the elements are
+// nums, syms and uniqs, so they need not be copied.
+my any memo_copy_key(memo m, any args) {
+  if(m->by_equal)
+    return copy(args);
+  listgen lg = listgen_new();
+  foreach(x, args)
+    listgen_add(&lg, x);
+  return lg.xs;
+}
+
+my any *memo_find(memo m, memo_gen *g, any args, uint64_t h) {
+  for(size_t i = h & g->mask;; i = (i + 1) & g->mask) {
+    any *slot = &g->slots[3 * i];
+    if(!slot[0] || ((uint64_t)slot[2] == h && memo_key_eql(m, slot[0], args)))
+      return slot;
+  }
+}
+
+my void memo_clear_gen(memo m, memo_gen *g) {
+  reg_reset(g->r);
+  memo_gen_init(m, g);
+}
+
+my void memo_add(memo m, any args, uint64_t h, any val) {
+  if(m->young.count == m->gen_capacity) {
+    m->evictions += m->old.count - m->old.moved;
+    memo_gen tmp = m->old;
+    m->old = m->young;
+    m->young = tmp;
+    memo_clear_gen(m, &m->young);
+  }
+  any *slot = memo_find(m, &m->young, args, h);
+  any volatile key = 0, copied = 0;
+  reg_push(m->young.r);
+  bool failed = false;
+  try { // so that a `throw` will not free the region of the generation
+    key = memo_copy_key(m, args);
+    copied = copy(val);
+  } catch {
+    failed = true;
+  }
+  reg_pop();
+  if(failed)
+    throw();
+  slot[0] = key;
+  slot[1] = copied;
+  slot[2] = (any)h;
+  m->young.count++;
+}
+
+my any memo_call(any cache, any subr, any args) {
+  memo m = any2memo(cache);
+  uint64_t h = memo_hash(m, args);
+  any *slot = memo_find(m, &m->young, args, h);
+  if(slot[0]) {
+    m->hits++;
+    return copy(slot[1]); // the generation may be reset later
+  }
+  slot = memo_find(m, &m->old, args, h);
+  if(slot[0]) {
+    m->hits++;
+    any res = copy(slot[1]); // before `memo_add()` may reset it
+    m->old.moved++;
+    memo_add(m, args, h, res); // move it to the young generation
+    return res;
+  }
+  m->misses++;
+  apply(subr, args);
+  any res = last_value;
+  memo_add(m, args, h, res);
+  return res;
+}
+
+//////////////// sorting ////////////////
+
+// `sort` recognizes the usual comparators and then compares natively
+// on an array instead of calling the comparator for each pair: lists
+// of fixnums get a radix sort, other nums and strs a merge sort.  For
+// any other comparator, the list is merge sorted in place.
+
+typedef enum { sort_generic, sort_num_up, sort_num_down, sort_str_up, sort_str_down } sort_kind;
+
+my bool is_binding_of(sub_code sc, const char *name) {
+  any binding = get_binding(intern(name));
+  return is(binding) && is_sub(fdr(binding)) && any2sub(fdr(binding))->code == sc;
+}
+
+my sort_kind get_sort_kind(any is_gt) {
+  if(!is_sub(is_gt))
+    return sort_generic;
+  sub_code sc = any2sub(is_gt)->code;
+  if(is_binding_of(sc, ">?") || is_binding_of(sc, "_fast>?"))
+    return sort_num_up;
+  if(is_binding_of(sc, "<?") || is_binding_of(sc, "_fast<?"))
+    return sort_num_down;
+  if(is_binding_of(sc, "str>?"))
+    return sort_str_up;
+  if(is_binding_of(sc, "str<?"))
+    return sort_str_down;
+  return sort_generic;
+}
+
+my bool num_gt(any a, any b) {
+  return (get_num_type(a) == t_num_int && get_num_type(b) == t_num_int)
+      ? any2int(a) > any2int(b)
+      : anynum2float(a) > anynum2float(b);
+}
+my bool num_lt(any a, any b) { return num_gt(b, a); }
+my bool str_gt(any a, any b) { return str_cmp(a, b) > 0; }
+my bool str_lt(any a, any b) { return str_cmp(a, b) < 0; }
+
+// Stable like `merge_sort()`: an element is only moved in front of
+// an earlier one if `is_gt(earlier, element)`.  Returns the buffer
+// holding the result, which is either `v` or `tmp`.
+my any *merge_sort_array(any *v, any *tmp, size_t n, bool (*is_gt)(any, any)) {
+  const size_t run = 16;
+  for(size_t lo = 0; lo < n; lo += run) { // insertion sort for short runs
+    size_t hi = lo + run < n ? lo + run : n;
+    for(size_t i = lo + 1; i < hi; i++) {
+      any x = v[i];
+      size_t j = i;
+      for(; j > lo && is_gt(v[j - 1], x); j--)
+        v[j] = v[j - 1];
+      v[j] = x;
+    }
+  }
+  for(size_t width = run; width < n; width *= 2) {
+    for(size_t lo = 0; lo < n; lo += 2 * width) {
+      size_t mid = lo + width < n ? lo + width : n;
+      size_t hi = lo + 2 * width < n ? lo + 2 * width : n;
+      size_t i = lo, j = mid, k = lo;
+      while(i < mid && j < hi)
+        tmp[k++] = is_gt(v[i], v[j]) ? v[j++] : v[i++];
+      while(i < mid)
+        tmp[k++] = v[i++];
+      while(j < hi)
+        tmp[k++] = v[j++];
+    }
+    any *swap = v;
+    v = tmp;
+    tmp = swap;
+  }
+  return v;
+}
+
+// Sort fixnums.  If there are fewer different values than nums, we
+// count how often each value occurs; otherwise an LSD radix sort with
+// 11 bits per pass is used.  Only the bits in which the nums differ
+// from the smallest one are looked at.  `tmp` must have room for `n`
+// words.  Returns the buffer holding the result, which is either `v`
+// or `tmp`.
+#define RADIX_BITS 11
+#define RADIX_MASK ((1 << RADIX_BITS) - 1)
+#define RADIX_PASSES 6 // enough for the 60 bits of fixnums
+
+my int64_t *radix_sort_ints(int64_t *v, int64_t *tmp, size_t n) {
+  int64_t min = v[0], max = v[0];
+  for(size_t i = 1; i < n; i++) {
+    if(v[i] < min)
+      min = v[i];
+    if(v[i] > max)
+      max = v[i];
+  }
+  uint64_t range = (uint64_t)max - (uint64_t)min; // fixnums have less than 64 bits, so no overflow
+  if(range < n) {
+    size_t *count = (size_t *)tmp;
+    memset(count, 0, (range + 1) * sizeof(size_t));
+    for(size_t i = 0; i < n; i++)
+      count[v[i] - min]++;
+    size_t k = 0;
+    for(uint64_t x = 0; x <= range; x++)
+      for(size_t c = count[x]; c; c--)
+        v[k++] = min + (int64_t)x;
+    return v;
+  }
+  int passes = 0;
+  while(passes < RADIX_PASSES && (range >> (RADIX_BITS * passes)) != 0)
+    passes++;
+  static size_t counts[RADIX_PASSES][1 << RADIX_BITS];
+  memset(counts, 0, sizeof(counts));
+  for(size_t i = 0; i < n; i++) {
+    uint64_t key = (uint64_t)v[i] - (uint64_t)min;
+    for(int d = 0; d < passes; d++)
+      counts[d][(key >> (RADIX_BITS * d)) & RADIX_MASK]++;
+  }
+  for(int d = 0; d < passes; d++) {
+    size_t *count = counts[d], pos = 0;
+    for(int b = 0; b <= RADIX_MASK; b++) {
+      size_t c = count[b];
+      count[b] = pos;
+      pos += c;
+    }
+    for(size_t i = 0; i < n; i++)
+      tmp[count[(((uint64_t)v[i] - (uint64_t)min) >> (RADIX_BITS * d)) & RADIX_MASK]++] = v[i];
+    int64_t *swap = v;
+    v = tmp;
+    tmp = swap;
+  }
+  return v;
+}
+
+my any sort(any is_gt, any xs) {
+  sort_kind kind = get_sort_kind(is_gt);
+  if(kind == sort_generic)
+    return merge_sort(is_gt, xs);
+  size_t n = 0;
+  bool all_ints = true;
+  foreach(x, xs) {
+    bool ok = (kind == sort_str_up || kind == sort_str_down) ? is_str(x) : is_num(x);
+    if(!ok) // let the comparator complain
+      return merge_sort(is_gt, xs);
+    all_ints = all_ints && is_num(x) && get_num_type(x) == t_num_int;
+    n++;
+  }
+  if(n < 2)
+    return merge_sort(is_gt, xs);
+  any *v = malloc(2 * n * sizeof(any)), *res;
+  size_t i = 0;
+  foreach(x, xs)
+    v[i++] = x;
+  if(all_ints) {
+    int64_t *ints = (int64_t *)v;
+    for(i = 0; i < n; i++)
+      ints[i] = any2int(v[i]);
+    ints = radix_sort_ints(ints, ints + n, n);
+    res = (any *)ints;
+    for(i = 0; i < n; i++)
+      res[i] = int2any(ints[i]);
+    if(kind == sort_num_down)
+      for(i = 0; i < n / 2; i++) {
+        any swap = res[i];
+        res[i] = res[n - 1 - i];
+        res[n - 1 - i] = swap;
+      }
+  } else {
+    bool (*gt)(any, any) = kind == sort_num_up ? num_gt
+                         : kind == sort_num_down ? num_lt
+                         : kind == sort_str_up ? str_gt : str_lt;
+    res = merge_sort_array(v, v + n, n, gt);
+  }
+  any sorted = NIL;
+  for(i = n; i > 0; i--)
+    sorted = cons(res[i - 1], sorted);
+  free(v);
+  return sorted;
+}
+
+//////////////// printer ////////////////
+
+my void print(any x);
+
+my void print_sub_args(any x) {
+  if(!is_cons(x)) {
+    if(!is_nil(x)) {
+      bprintf(". ");
+      print(x);
+      bputc(' ');
+    }
+    return;
+  }
+  print(far(x));
+  bputc(' ');
+  print_sub_args(fdr(x));
+}
+
+my bool is_arglist(any x) {
+  if(is_nil(x) || is_sym(x))
+    return true;
+  if(is_cons(x) && is_sym(far(x)) && is_arglist(fdr(x)))
+    return true;
+  return false;
+}
+
+my void print(any x) {
+  switch (tag_of(x)) {
+  case t_cons: {
+    any a = far(x);
+    if(is_sym(a)) {
+      if(a == s_quote)            { bputc('\'');   print(fdr(x)); break; }
+      if(a == s_unquote)          { bputc(',');    print(fdr(x)); break; }
+      if(a == s_unquote_splicing) { bprintf(",@"); print(fdr(x)); break; }
+      if(a == s_quasiquote && is_cons(fdr(x)) && is_nil(fdr(fdr(x)))) {
+        bputc('`');
+        print(far(fdr(x)));
+        break;
+      }
+      if(a == s_lambda  && is_cons(fdr(x)) && is_arglist(far(fdr(x))) && is_single(fdr(fdr(x))) && is_cons(far(fdr(fdr(x))))) {
+        bprintf("| ");
+        print_sub_args(far(fdr(x)));
+        print(far(fdr(fdr(x))));
+        break;
+      }
+    }
+    bool first = true;
+    bputc('(');
+    do {
+      if(first)
+        first = false;
+      else
+        bputc(' ');
+      print(far(x));
+      x = fdr(x);
+    } while(is_tagged(x, t_cons));
+    if(x != NIL) {
+      bprintf(" . ");
+      print(x);
+    }
+    bputc(')');
+    break;
+  }
+  case t_sym: {
+    const char *name = symtext(x);
+    dst_write(cur_dst(), name, strlen(name));
+    break;
+  }
+  case t_num:
+    switch (get_num_type(x)) {
+    case t_num_int: bprint_int(any2int(x)); break;
+    case t_num_float: bprintf("%g", (double)any2float(x)); break;
+    default: abort();
+    }
+    break;
+  case t_uniq:
+    switch (x) {
+    case NIL: bprintf("()"); break;
+    case BTRUE: bprintf("#t"); break;
+    case BFALSE: bprintf("#f"); break;
+    case ENDOFFILE: bprintf("#{eof}"); break;
+    default:
+      bprintf("#{?}");
+    }
+    break;
+  case t_str: {
+    stream s = cur_dst();
+    dst_putc(s, '"');
+    foreach(c, unstr(x))
+      switch (any2int(c)) {
+      case '"': dst_write(s, "\\\"", 2); break;
+      case '\\': dst_write(s, "\\\\", 2); break;
+      case '\n': dst_write(s, "\\n", 2); break;
+      case '\t': dst_write(s, "\\t", 2); break;
+      default:
+        dst_putc(s, any2int(c));
+      }
+    dst_putc(s, '"');
+    break;
+  }
+  case t_sub:
+    bprintf("#sub(id=%p name=", (void *)x);
+    sub_code code = any2sub(x)->code;
+    print(code->name);
+    bprintf(" argc=%d take-rest?=", code->argc);
+    print(code->take_rest ? BTRUE : BFALSE);
+    bputc(')');
+    break;
+  case t_other:
+    switch(get_other_type(x)) {
+    case t_other_src:
+      bprintf("#{src ");
+      print(get_filename(x));
+      bprintf(":%d}", input_line(x));
+      break;
+    case t_other_dst:
+      bprintf("#{dst ");
+      print(get_filename(x));
+      bputc('}');
+      break;
+    case t_other_promise:
+      bprintf(any2promise(x)->forced ? "#{promise forced}" : "#{promise}");
+      break;
+    case t_other_memo:
+      bprintf("#{memo-cache %zu}", any2memo(x)->young.count + any2memo(x)->old.count);
+      break;
+    case t_other_bytes: {
+      bytes b = any2bytes(x);
+      bprintf("#{bytes");
+      for(size_t i = 0; i != b->len; i++)
+        bprintf(" %02x", b->data[i]);
+      bputc('}');
+      break;
+    }
+    default:
+      abort();
+    }
+    break;
+  default:
+    abort();
+  }
+}
+
+my void say_str(any x) {
+  stream s = cur_dst();
+  foreach(chr, unstr(x))
+    dst_putc(s, any2int(chr));
+}
+
+my void say(any x) {
+  switch (tag_of(x)) {
+  case t_str:
+    say_str(x);
+    break;
+  case t_cons:
+    foreach(e, x)
+      say(e);
+    break;
+  default:
+    print(x);
+  }
+}
+
+my void eprint(any x) {
+  if(!silence_errors) {
+    any old = dynamic_vals[dyn_dst];
+    dynamic_vals[dyn_dst] = get_dyn_val(intern("*stderr*"));
+    print(x);
+    dynamic_vals[dyn_dst] = old;
+  }
+}
+
+//////////////// reader ////////////////
+
+my void parse_error(const char *text) {
+  eprint(dynamic_vals[dyn_src]);
+  eprintf(": parse error: %s\n", text);
+  throw();
+} 
+
+// These can be used for syms in s-exprs
+// Disallowed are the first 32 and "#'(),@:;[]`{}|
+my bool allowed_chars[] = {
   0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
   0,1,0,0,1,1,1,0,0,0,1,1,0,1,1,1,1,1,1,1,1,1,1,1,1,1,0,0,1,1,1,1,
   0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,0,1,0,1,1,
@@ -1246,7 +2784,13 @@ my void skip_until(char end) {
 }
 
 my int find_token() {
+  stream s = cur_src();
   while(1) {
+    while(s->pos != s->end && (*s->pos == ' ' || *s->pos == '\n')) {
+      if(*s->pos == '\n')
+        s->line++;
+      s->pos++;
+    }
     int c = nextc();
     switch (c) {
     case ';':
@@ -1264,65 +2808,108 @@ my int find_token() {
   }
 }
 
-my int digit2int(any chr) {
-  int dig = any2int(chr) - '0';
-  return (dig >= 0 && dig <= 9) ? dig : -1;
+// Tokens that are not completely in the src buffer are collected here.
+my struct {
+  char *buf;
+  size_t len, size;
+} token;
+
+my void token_add(int c) {
+  if(token.size - token.len < 4) { // enough for any UTF-8 char
+    token.size = token.size ? 2 * token.size : 256;
+    token.buf = realloc(token.buf, token.size);
+  }
+  char *p = token.buf + token.len;
+  utf8to_strp(c, &p);
+  token.len = p - token.buf;
+}
+
+my void token_add_n(const unsigned char *p, size_t n) {
+  if(token.size - token.len < n + 4) {
+    while(token.size - token.len < n + 4)
+      token.size = token.size ? 2 * token.size : 256;
+    token.buf = realloc(token.buf, token.size);
+  }
+  memcpy(token.buf + token.len, p, n);
+  token.len += n;
 }
 
-my any chars2num(any chrs) {
+my any bytes2num(const char *s, size_t len) {
   int64_t ires = 0;
-  int pos = 0, decimal_point_pos = -1;
-  bool is_positive = true, is_num = false; // need `is_num` to catch "", ".", "+" and "-"
-  foreach (chr, chrs) {
-    int dig = digit2int(chr);
-    pos++;
-    if(dig == -1) {
-      if(pos == 1 && any2int(chr) == '-') {
+  bool is_positive = true, is_num = false, is_float = false; // need `is_num` to catch "", ".", "+" and "-"
+  for(size_t i = 0; i != len; i++) {
+    char c = s[i];
+    if(c < '0' || c > '9') {
+      if(i == 0 && c == '-') {
         is_positive = false;
         continue;
       }
-      if(pos == 1 && any2int(chr) == '+')
+      if(i == 0 && c == '+')
         continue;
-      if(decimal_point_pos == -1 && any2int(chr) == '.') {
-        decimal_point_pos = pos;
+      if(!is_float && c == '.') {
+        is_float = true;
         continue;
       }
       return BFALSE;
     }
     is_num = true;
-    ires *= 10;
-    ires += dig;
+    ires = 10 * ires + (c - '0');
   }
-  if(is_num)
-    if(decimal_point_pos < 0)
-      return int2any(is_positive ? ires : -ires);
-    else {
-      float f = is_positive ? ires : -ires;
-      for(; decimal_point_pos < pos; decimal_point_pos++)
-        f /= 10.0;
-      return float2any(f);
-    }
-  else
+  if(!is_num)
     return BFALSE;
+  if(!is_float)
+    return int2any(is_positive ? ires : -ires);
+  if(s != token.buf) { // `strtod()` needs a terminated str
+    token.len = 0;
+    for(size_t i = 0; i != len; i++)
+      token_add(s[i]);
+  }
+  token_add('\0');
+  return float2any(strtod(token.buf, NULL));
 }
 
-my any chars_to_num_or_sym(any cs) {
-  any num = chars2num(cs);
-  return is(num) ? num : intern_from_chars(cs);
+my any bytes_to_num_or_sym(const char *s, size_t len) {
+  any num = bytes2num(s, len);
+  return is(num) ? num : intern_n(s, len);
 }
 
-my any read_sym_chars(int start_char) {
-  listgen lg = listgen_new();
-  listgen_add(&lg, int2any(start_char));
-  int c;
-  while(is_symchar(c = look()))
-    listgen_add(&lg, int2any(nextc()));
-  return lg.xs;
+// `c` has already been read.  If the whole token is ASCII and
+// available in the buffer (always the case for mapped files and strs), parse
+// it from there, otherwise collect it in `token`.
+my any read_sym_or_num(int c) {
+  stream s = cur_src();
+  if(c < 0x80 && s->pos != s->buf && s->pos[-1] == c) {
+    unsigned char *start = s->pos - 1, *p = s->pos;
+    while(p != s->end && *p < 0x80 && allowed_chars[*p])
+      p++;
+    if(p != s->end ? *p < 0x80 : s->complete) {
+      s->pos = p;
+      return bytes_to_num_or_sym((const char *)start, p - start);
+    }
+  }
+  token.len = 0;
+  token_add(c);
+  while(1) {
+    while(s->pos != s->end && *s->pos < 0x80 && allowed_chars[*s->pos])
+      token_add(*s->pos++);
+    if(s->pos != s->end && *s->pos < 0x80)
+      break; // an ASCII char that ends the token
+    if(!is_symchar(look()))
+      break;
+    token_add(nextc());
+  }
+  return bytes_to_num_or_sym(token.buf, token.len);
 }
 
 my any read_str() {
   listgen lg = listgen_new();
+  stream s = cur_src();
   while(1) {
+    while(s->pos != s->end && *s->pos < 0x80 && *s->pos != '"' && *s->pos != '\\') {
+      if(*s->pos == '\n')
+        s->line++;
+      listgen_add(&lg, int2any(*s->pos++));
+    }
     int c = nextc();
     if(c == '"')
       return str(lg.xs);
@@ -1413,7 +3000,7 @@ my any reader() {
   case EOF:
     return ENDOFFILE;
   default:
-    return (chars_to_num_or_sym(read_sym_chars(c)));
+    return read_sym_or_num(c);
   }
 }
 
@@ -1424,6 +3011,445 @@ my any bone_read() {
   return x;
 }
 
+//////////////// JSON ////////////////
+
+// Objects are read as alists with syms as keys, e.g. ((a 1) (b "x")),
+// and arrays as lists.  As JSON values never are syms, a list is an
+// object exactly if its elements are lists starting with a sym, and
+// the syms `null` and `empty-object` can stand for null and {},
+// so that () is the empty array.
+// Syms are never freed, so with `*json-str-keys*` the keys are strs
+// instead, which live in the current reg like the rest of the document.
+
+#define JSON_MAX_DEPTH 10000
+
+my int dyn_json_str_keys;
+my bool json_str_keys() { return is(dynamic_vals[dyn_json_str_keys]); }
+
+// Skip whitespace and return the next byte without consuming it.
+my int json_look(stream s) {
+  while(1) {
+    while(s->pos != s->end) {
+      switch(*s->pos) {
+      case '\n': s->line++; // fall through
+      case ' ': case '\t': case '\r':
+        s->pos++;
+        continue;
+      default:
+        return *s->pos;
+      }
+    }
+    if(!src_fill(s, 1))
+      return EOF;
+  }
+}
+
+my void json_expect(stream s, const char *word) {
+  size_t n = strlen(word);
+  if(!src_fill(s, n) || memcmp(s->pos, word, n))
+    parse_error("invalid JSON literal");
+  s->pos += n;
+}
+
+my int json_hex4(stream s) {
+  if(!src_fill(s, 4))
+    parse_error("end of file in JSON \\u escape");
+  int res = 0;
+  for(int i = 0; i < 4; i++) {
+    int c = *s->pos++, digit = c >= '0' && c <= '9' ? c - '0'
+                             : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                             : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+    if(digit < 0)
+      parse_error("invalid JSON \\u escape");
+    res = 16 * res + digit;
+  }
+  return res;
+}
+
+my int json_escape(stream s) {
+  if(!src_fill(s, 1))
+    parse_error("end of file after backslash in JSON str");
+  switch(*s->pos++) {
+  case '"': return '"';
+  case '\\': return '\\';
+  case '/': return '/';
+  case 'b': return '\b';
+  case 'f': return '\f';
+  case 'n': return '\n';
+  case 'r': return '\r';
+  case 't': return '\t';
+  case 'u': {
+    int c = json_hex4(s);
+    if(c < 0xD800 || c > 0xDFFF)
+      return c;
+    if(c < 0xDC00 && src_fill(s, 6) && s->pos[0] == '\\' && s->pos[1] == 'u') {
+      unsigned char *pos = s->pos;
+      s->pos += 2;
+      int low = json_hex4(s);
+      if(low >= 0xDC00 && low <= 0xDFFF)
+        return 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+      s->pos = pos;
+    }
+    return 0xFFFD; // unpaired surrogate
+  }
+  default:
+    parse_error("invalid character after backslash in JSON str");
+    return EOF;
+  }
+}
+
+// The opening quote has already been read.
+my listgen json_read_chars(stream s) {
+  listgen lg = listgen_new();
+  while(1) {
+    while(s->pos != s->end && *s->pos < 0x80 && *s->pos >= ' ' && *s->pos != '"' && *s->pos != '\\')
+      listgen_add(&lg, int2any(*s->pos++));
+    int c = src_getc(s);
+    if(c == '"')
+      return lg;
+    if(c == EOF)
+      parse_error("end of file inside of a JSON str");
+    if(c == '\\')
+      c = json_escape(s);
+    else if(c < ' ')
+      parse_error("control character in JSON str");
+    listgen_add(&lg, int2any(c));
+  }
+}
+
+// Keys are interned directly from the buffer when they are plain ASCII.
+my any json_read_key(stream s) {
+  if(json_look(s) != '"')
+    parse_error("expected str as JSON object key");
+  s->pos++;
+  if(json_str_keys())
+    return str(json_read_chars(s).xs);
+  unsigned char *p = s->pos;
+  while(p != s->end && *p < 0x80 && *p >= ' ' && *p != '"' && *p != '\\')
+    p++;
+  if(p != s->end && *p == '"') {
+    any res = intern_n((const char *)s->pos, p - s->pos);
+    s->pos = p + 1;
+    return res;
+  }
+  return intern_from_chars(json_read_chars(s).xs);
+}
+
+my any json_read_num(stream s) {
+  token.len = 0;
+  bool is_float = false;
+  while(1) {
+    if(s->pos == s->end && !src_fill(s, 1))
+      break;
+    int c = *s->pos;
+    if(c == '.' || c == 'e' || c == 'E')
+      is_float = true;
+    else if(!(c >= '0' && c <= '9') && c != '-' && c != '+')
+      break;
+    token_add(c);
+    s->pos++;
+  }
+  token_add('\0');
+  char *end;
+  if(!is_float) {
+    errno = 0;
+    long long n = strtoll(token.buf, &end, 10);
+    if(*end)
+      parse_error("invalid JSON number");
+    if(errno != ERANGE && n >= BONE_INT_MIN && n <= BONE_INT_MAX)
+      return int2any(n);
+  }
+  double d = strtod(token.buf, &end);
+  if(*end || end == token.buf)
+    parse_error("invalid JSON number");
+  return float2any(d);
+}
+
+my any json_read_value(stream s, int depth);
+
+my any json_read_array(stream s, int depth) {
+  listgen lg = listgen_new();
+  if(json_look(s) == ']') {
+    s->pos++;
+    return NIL;
+  }
+  while(1) {
+    listgen_add(&lg, json_read_value(s, depth));
+    int c = json_look(s);
+    s->pos++;
+    if(c == ']')
+      return lg.xs;
+    if(c != ',')
+      parse_error("expected , or ] in JSON array");
+  }
+}
+
+my any json_read_object(stream s, int depth) {
+  listgen lg = listgen_new();
+  if(json_look(s) == '}') {
+    s->pos++;
+    return s_empty_object;
+  }
+  while(1) {
+    any key = json_read_key(s);
+    if(json_look(s) != ':')
+      parse_error("expected : in JSON object");
+    s->pos++;
+    listgen_add(&lg, list2(key, json_read_value(s, depth)));
+    int c = json_look(s);
+    s->pos++;
+    if(c == '}')
+      return lg.xs;
+    if(c != ',')
+      parse_error("expected , or } in JSON object");
+  }
+}
+
+my any json_read_value(stream s, int depth) {
+  if(depth == JSON_MAX_DEPTH)
+    parse_error("JSON nested too deeply");
+  int c = json_look(s);
+  switch(c) {
+  case '{': s->pos++; return json_read_object(s, depth + 1);
+  case '[': s->pos++; return json_read_array(s, depth + 1);
+  case '"': s->pos++; return str(json_read_chars(s).xs);
+  case 't': json_expect(s, "true"); return BTRUE;
+  case 'f': json_expect(s, "false"); return BFALSE;
+  case 'n': json_expect(s, "null"); return s_null;
+  case EOF: parse_error("end of file in JSON value"); return BFALSE;
+  default:
+    if(c == '-' || (c >= '0' && c <= '9'))
+      return json_read_num(s);
+    parse_error("unexpected character in JSON");
+    return BFALSE;
+  }
+}
+
+// Returns ENDOFFILE if there is nothing but whitespace left in the
+// current src, so a sequence of values (e.g. one per line) can be read.
+my any read_json() {
+  stream s = cur_src();
+  if(json_look(s) == EOF)
+    return ENDOFFILE;
+  return json_read_value(s, 0);
+}
+
+my void print_json_chr(stream s, int c) {
+  switch(c) {
+  case '"': dst_write(s, "\\\"", 2); break;
+  case '\\': dst_write(s, "\\\\", 2); break;
+  case '\n': dst_write(s, "\\n", 2); break;
+  case '\r': dst_write(s, "\\r", 2); break;
+  case '\t': dst_write(s, "\\t", 2); break;
+  default:
+    if(c < ' ') {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      dst_write(s, buf, 6);
+    } else
+      dst_putc(s, c);
+  }
+}
+
+my void print_json_str(stream s, any chrs) {
+  dst_putc(s, '"');
+  foreach(c, chrs)
+    print_json_chr(s, any2int(c));
+  dst_putc(s, '"');
+}
+
+// Sym names are UTF-8 already, so non-ASCII bytes can be copied as they are.
+my void print_json_sym(stream s, any sym) {
+  dst_putc(s, '"');
+  for(const unsigned char *p = (const unsigned char *)symtext(sym); *p; p++)
+    if(*p < 0x80)
+      print_json_chr(s, *p);
+    else
+      dst_write(s, (const char *)p, 1);
+  dst_putc(s, '"');
+}
+
+my bool is_json_object(any x) {
+  if(!is_cons(x))
+    return false;
+  type_tag key_type = json_str_keys() ? t_str : t_sym;
+  foreach(entry, x)
+    if(!is_cons(entry) || !is_tagged(far(entry), key_type) || !is_single(fdr(entry)))
+      return false;
+  return true;
+}
+
+my void print_json(any x) {
+  stream s = cur_dst();
+  switch(tag_of(x)) {
+  case t_cons: {
+    bool is_object = is_json_object(x);
+    dst_putc(s, is_object ? '{' : '[');
+    bool first = true;
+    foreach(elem, x) {
+      if(!first)
+        dst_putc(s, ',');
+      first = false;
+      if(is_object) {
+        if(is_str(far(elem)))
+          print_json_str(s, unstr(far(elem)));
+        else
+          print_json_sym(s, far(elem));
+        dst_putc(s, ':');
+        print_json(far(fdr(elem)));
+      } else
+        print_json(elem);
+    }
+    dst_putc(s, is_object ? '}' : ']');
+    return;
+  }
+  case t_str: print_json_str(s, unstr(x)); return;
+  case t_sym:
+    if(x == s_null)
+      dst_write(s, "null", 4);
+    else if(x == s_empty_object)
+      dst_write(s, "{}", 2);
+    else
+      print_json_sym(s, x);
+    return;
+  case t_num:
+    if(get_num_type(x) == t_num_int)
+      bprint_int(any2int(x));
+    else {
+      float f = any2float(x);
+      if(isnan(f) || isinf(f))
+        generic_error("cannot print as JSON", x);
+      bprintf("%.9g", (double)f);
+    }
+    return;
+  case t_uniq:
+    switch(x) {
+    case NIL: dst_write(s, "[]", 2); return;
+    case BTRUE: dst_write(s, "true", 4); return;
+    case BFALSE: dst_write(s, "false", 5); return;
+    }
+    break;
+  default:
+    break;
+  }
+  generic_error("cannot print as JSON", x);
+}
+
+//////////////// CSV ////////////////
+
+// Fields are separated by `delim` and may be quoted with `"`, which
+// allows the delimiter, newlines and `""` (for a quote) inside of them.
+// Unquoted fields that look like numbers are read as nums.  Fields are
+// collected in `token`; bytes of UTF-8 sequences never equal an ASCII
+// delimiter, so they are just copied and decoded when the field is done.
+
+my int csv_delim(any x) {
+  any chrs = unstr(x);
+  if(!is_single(chrs) || any2int(far(chrs)) >= 0x80 || any2int(far(chrs)) == '"')
+    generic_error("invalid CSV delimiter", x);
+  return any2int(far(chrs));
+}
+
+my int csv_look(stream s) { return s->pos != s->end || src_fill(s, 1) ? *s->pos : EOF; }
+
+my void csv_read_quoted(stream s) {
+  s->pos++; // opening quote
+  while(1) {
+    if(!src_fill(s, 1))
+      parse_error("end of file inside of a quoted CSV field");
+    unsigned char *q = memchr(s->pos, '"', s->end - s->pos), *limit = q ? q : s->end;
+    for(unsigned char *p = s->pos; p != limit; p++)
+      s->line += *p == '\n';
+    token_add_n(s->pos, limit - s->pos);
+    s->pos = limit;
+    if(!q)
+      continue;
+    s->pos++;
+    if(csv_look(s) != '"')
+      return;
+    token_add('"');
+    s->pos++;
+  }
+}
+
+my any csv_read_field(stream s, int delim, bool nums) {
+  token.len = 0;
+  if(csv_look(s) == '"') {
+    csv_read_quoted(s);
+    int c = csv_look(s);
+    if(c != delim && c != '\n' && c != '\r' && c != EOF)
+      parse_error("unexpected character after quoted CSV field");
+    return utf8_bytes2str((unsigned char *)token.buf, token.len);
+  }
+  while(src_fill(s, 1)) {
+    unsigned char *p = s->pos;
+    while(p != s->end && *p != delim && *p != '\n' && *p != '\r')
+      p++;
+    token_add_n(s->pos, p - s->pos);
+    s->pos = p;
+    if(p != s->end)
+      break;
+  }
+  if(nums && token.len) {
+    any num = bytes2num(token.buf, token.len);
+    if(is(num))
+      return num;
+  }
+  return utf8_bytes2str((unsigned char *)token.buf, token.len);
+}
+
+// Returns ENDOFFILE when there are no more rows.  Empty lines are skipped.
+my any csv_read_row(int delim, bool nums) {
+  stream s = cur_src();
+  int c;
+  while((c = csv_look(s)) == '\n' || c == '\r') {
+    s->line += c == '\n';
+    s->pos++;
+  }
+  if(c == EOF)
+    return ENDOFFILE;
+  listgen lg = listgen_new();
+  while(1) {
+    listgen_add(&lg, csv_read_field(s, delim, nums));
+    c = csv_look(s);
+    if(c == EOF)
+      return lg.xs;
+    s->pos++;
+    if(c == delim)
+      continue;
+    if(c == '\r' && csv_look(s) == '\n')
+      s->pos++;
+    s->line++;
+    return lg.xs;
+  }
+}
+
+// The header is read as strs and turned into syms, which are used as
+// keys of the alist that each following row becomes.
+my any csv_read_header(int delim) {
+  any row = csv_read_row(delim, false);
+  if(row == ENDOFFILE)
+    return NIL;
+  listgen lg = listgen_new();
+  foreach(name, row)
+    listgen_add(&lg, intern_from_chars(unstr(name)));
+  return lg.xs;
+}
+
+my any csv_row2alist(any header, any row) {
+  listgen lg = listgen_new();
+  any names = header;
+  foreach(field, row) {
+    if(!is_cons(names))
+      basic_error("CSV row in line %d has more fields than the header", cur_src()->line - 1);
+    listgen_add(&lg, list2(far(names), field));
+    names = fdr(names);
+  }
+  if(is_cons(names))
+    basic_error("CSV row in line %d has fewer fields than the header", cur_src()->line - 1);
+  return lg.xs;
+}
+
 //////////////// evaluator ////////////////
 
 typedef enum {
@@ -1452,18 +3478,41 @@ typedef enum {
   OP_INSERT_DECLARED
 } opcode;
 
+#ifdef BONE_VM_STATS // count executed instructions, see `vm-stats`
+#define OP_CNT (OP_INSERT_DECLARED + 1)
+my const char *op_names[OP_CNT] = {
+  "<start>", "CONST", "GET_ENV", "GET_ARG", "SET_LOCAL", "WRAP", "PREPARE_CALL",
+  "PREPARE_DIRECT_CALL", "CALL", "TAILCALL", "ADD_ARG", "ADD_NONREST_ARG",
+  "ADD_FIRST_REST_ARG", "ADD_ANOTHER_REST_ARG", "JMP_IFN", "JMP", "RET",
+  "PREPARE_SUB", "ADD_ENV", "MAKE_SUB_NAMED", "MAKE_SUB", "MAKE_RECURSIVE",
+  "DYN", "INSERT_DECLARED"
+};
+my uint64_t op_cnts[OP_CNT], op_pair_cnts[OP_CNT][OP_CNT]; // pairs: [previous][current]
+my uint64_t rest_arg_fallbacks, declared_patches;
+my void count_op(int *prev, any op) {
+  op_cnts[op]++;
+  op_pair_cnts[*prev][op]++;
+  *prev = op;
+}
+#define count_event(cnt) ((cnt)++)
+#else
+#define count_op(prev, op)
+#define count_event(cnt)
+#endif
+
 void bone_result(any x) { last_value = x; }
+// The locals stack must never move, as csubs keep pointers to their
+// args while calling subs.  Thus we reserve address space for the
+// biggest size we allow; the OS will only provide pages that get used.
+#define LOCALS_MAX (1 << 24)
 my any *locals_stack = NULL; // FIXME: thread-local
-my size_t locals_allocated; // FIXME: thread-local
 my size_t locals_pos; // FIXME: thread-local
 
 my size_t alloc_locals(int n) {
   size_t res = locals_pos;
+  if(res + n > LOCALS_MAX)
+    basic_error("stack overflow");
   locals_pos += n;
-  if(locals_pos > locals_allocated) {
-    locals_allocated *= 2;
-    locals_stack = realloc(locals_stack, locals_allocated * sizeof(any));
-  }
   return res;
 }
 
@@ -1473,6 +3522,8 @@ struct call_stack_entry {
   sub subr;
   size_t args_pos;
   int tail_calls;
+  uint64_t start_ns, children_ns; // only used while counting calls; 0 = not timed
+  bool traced;                    // only used while tracing
 } *call_stack;
 my size_t call_stack_allocated;
 my size_t call_stack_pos;
@@ -1563,21 +3614,274 @@ my void verify_argc(struct upcoming_call *the_call) {
     args_error_unspecific(the_call->to_be_called->code);
 }
 
+// Exact call counts and times per sub for `with-call-profiling`.
+my bool counting_calls;
+my sub_code *counted_subs; // the ones called since counting started
+my size_t counted_subs_cnt, counted_subs_allocated;
+
+my uint64_t now_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+my void enter_call() {
+  struct call_stack_entry *e = &call_stack[call_stack_pos];
+  sub_code sc = e->subr->code;
+  if(!sc->calls) {
+    if(counted_subs_cnt == counted_subs_allocated) {
+      counted_subs_allocated = counted_subs_allocated ? 2 * counted_subs_allocated : 256;
+      counted_subs = realloc(counted_subs, counted_subs_allocated * sizeof(sub_code));
+    }
+    counted_subs[counted_subs_cnt++] = sc;
+  }
+  sc->calls++;
+  sc->active++;
+  e->children_ns = 0;
+  e->start_ns = now_ns();
+}
+
+my void leave_call() {
+  struct call_stack_entry *e = &call_stack[call_stack_pos];
+  if(!e->start_ns)
+    return;
+  sub_code sc = e->subr->code;
+  uint64_t elapsed = now_ns() - e->start_ns;
+  sc->excl_ns += elapsed - e->children_ns;
+  if(--sc->active == 0) // don't count time in recursive calls twice
+    sc->incl_ns += elapsed;
+  call_stack[call_stack_pos - 1].children_ns += elapsed;
+  e->start_ns = 0;
+}
+
+my void start_counting_calls() {
+  for(size_t i = 0; i != counted_subs_cnt; i++) {
+    sub_code sc = counted_subs[i];
+    sc->active = 0;
+    sc->calls = sc->incl_ns = sc->excl_ns = 0;
+  }
+  counted_subs_cnt = 0;
+  for(size_t pos = 0; pos <= call_stack_pos; pos++) // the ones already running are not timed
+    call_stack[pos].start_ns = 0;
+  counting_calls = true;
+}
+
+// Events for `with-tracing`, which are written in the trace event
+// format of Chrome (also understood by Perfetto).
+#define TRACE_EVENTS (1 << 20)
+typedef struct trace_event {
+  uint64_t ts_ns;
+  const char *name, *file; // `file` may be NULL
+  const char *arg_name;    // NULL if there is no `arg`
+  int64_t arg;
+  char phase;              // 'B'egin or 'E'nd
+} *trace_event;
+my bool tracing;
+my trace_event trace_events; // a ring buffer; the oldest ones are overwritten
+my size_t trace_events_next, trace_events_cnt;
+my uint64_t trace_start_ns;
+my sub_code *traced_subs;
+my size_t traced_subs_cnt;
+
+my void trace(char phase, const char *name, const char *file, const char *arg_name, int64_t arg) {
+  trace_event e = &trace_events[trace_events_next];
+  e->ts_ns = now_ns();
+  e->name = name;
+  e->file = file;
+  e->arg_name = arg_name;
+  e->arg = arg;
+  e->phase = phase;
+  trace_events_next = (trace_events_next + 1) % TRACE_EVENTS;
+  if(trace_events_cnt != TRACE_EVENTS)
+    trace_events_cnt++;
+}
+
+// For names of files which have to stay valid until the trace is written.
+my const char *trace_name(any str) {
+  char *s = str2charp(str);
+  any res = intern(s);
+  free(s);
+  return symtext(res);
+}
+
+my const char *sub_code_name(sub_code sc) { return is(sc->name) ? symtext(sc->name) : "<unknown>"; }
+
+my void trace_call() {
+  struct call_stack_entry *e = &call_stack[call_stack_pos];
+  e->traced = e->subr->code->traced;
+  if(e->traced)
+    trace('B', sub_code_name(e->subr->code), NULL, NULL, 0);
+}
+
+my void trace_return() {
+  struct call_stack_entry *e = &call_stack[call_stack_pos];
+  if(e->traced)
+    trace('E', sub_code_name(e->subr->code), NULL, NULL, 0);
+  e->traced = false;
+}
+
+// When an error passes a traced event, the calls it cut short must end
+// before the event itself does.  Their entries stay for the backtrace.
+my void trace_end_calls(size_t csp) {
+  size_t pos = call_stack_pos;
+  for(; call_stack_pos > csp; call_stack_pos--)
+    trace_return();
+  call_stack_pos = pos;
+}
+
+// Call `f` within the traced event `name`, ending it if `f` throws.
+my void call0_in_trace(any f, const char *name, const char *file) {
+  if(!tracing) {
+    call0(f);
+    return;
+  }
+  size_t csp = call_stack_pos;
+  bool failed = false;
+  try {
+    call0(f);
+  } catch {
+    failed = true;
+  }
+  if(failed) {
+    trace_end_calls(csp);
+    trace('E', name, file, NULL, 0);
+    throw();
+  }
+}
+
+my void json_str(FILE *fp, const char *s) {
+  fputc('"', fp);
+  for(; *s; s++)
+    if(*s == '"' || *s == '\\')
+      fprintf(fp, "\\%c", *s);
+    else if((unsigned char)*s < ' ')
+      fprintf(fp, "\\u%04x", *s);
+    else
+      fputc(*s, fp);
+  fputc('"', fp);
+}
+
+my void write_trace(FILE *fp) {
+  fprintf(fp, "{\"traceEvents\":[");
+  size_t i = (trace_events_next + TRACE_EVENTS - trace_events_cnt) % TRACE_EVENTS;
+  size_t open = 0, written = 0;
+  for(size_t n = 0; n != trace_events_cnt; n++, i = (i + 1) % TRACE_EVENTS) {
+    trace_event e = &trace_events[i];
+    if(e->phase == 'B')
+      open++;
+    else if(open)
+      open--;
+    else // its 'B' was overwritten in the ring buffer
+      continue;
+    fprintf(fp, "%s\n{\"name\":", written++ ? "," : "");
+    json_str(fp, e->name);
+    fprintf(fp, ",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":1",
+            e->phase, (e->ts_ns - trace_start_ns) / 1e3, (int)getpid());
+    if(e->file || e->arg_name) {
+      fprintf(fp, ",\"args\":{");
+      if(e->file) {
+        fprintf(fp, "\"file\":");
+        json_str(fp, e->file);
+      }
+      if(e->arg_name)
+        fprintf(fp, "%s\"%s\":%" PRId64, e->file ? "," : "", e->arg_name, e->arg);
+      fprintf(fp, "}");
+    }
+    fprintf(fp, "}");
+  }
+  fprintf(fp, "\n]}\n");
+}
+
+// Hooks for `call()`; `call_hooks` is true if any of them is needed.
+my bool call_hooks;
+my void update_call_hooks() { call_hooks = counting_calls || tracing; }
+
+my void call_entered() {
+  if(counting_calls)
+    enter_call();
+  if(tracing)
+    trace_call();
+}
+
+my void call_leaving() {
+  if(counting_calls)
+    leave_call();
+  if(tracing)
+    trace_return();
+}
+
+// To be used instead of simply setting `call_stack_pos` after an exception.
+my void unwind_call_stack(size_t pos) {
+  if(call_hooks)
+    for(; call_stack_pos > pos; call_stack_pos--)
+      call_leaving();
+  call_stack_pos = pos;
+}
+
+void bone_trace_start() {
+  if(!trace_events)
+    trace_events = malloc(TRACE_EVENTS * sizeof(struct trace_event));
+  trace_events_next = trace_events_cnt = 0;
+  trace_start_ns = now_ns();
+  for(size_t pos = 0; pos <= call_stack_pos; pos++) // the ones already running are not traced
+    call_stack[pos].traced = false;
+  tracing = true;
+  update_call_hooks();
+}
+
+void bone_trace_stop(FILE *fp) {
+  if(!tracing)
+    return;
+  tracing = false;
+  update_call_hooks();
+  if(fp)
+    write_trace(fp);
+}
+
+my int cmp_excl_time(const void *a, const void *b) {
+  uint64_t x = (*(sub_code *)a)->excl_ns, y = (*(sub_code *)b)->excl_ns;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+my void print_call_profile(int n) {
+  qsort(counted_subs, counted_subs_cnt, sizeof(sub_code), cmp_excl_time);
+  bprintf("%12s %12s %12s  %s\n", "calls", "incl ms", "excl ms", "sub");
+  for(size_t i = 0; i != counted_subs_cnt && (int)i != n; i++) {
+    sub_code sc = counted_subs[i];
+    bprintf("%12" PRIu64 " %12.3f %12.3f  %s\n", sc->calls, sc->incl_ns / 1e6, sc->excl_ns / 1e6,
+            is(sc->name) ? symtext(sc->name) : "<unknown>");
+  }
+}
+
+my void grow_call_stack() {
+  sigset_t prof, old; // the CPU profiler must not look at the call stack while it moves
+  sigemptyset(&prof);
+  sigaddset(&prof, SIGPROF);
+  sigprocmask(SIG_BLOCK, &prof, &old);
+  call_stack_allocated *= 2;
+  call_stack = realloc(call_stack, call_stack_allocated * sizeof(*call_stack));
+  sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
 my void call(sub subr, size_t args_pos, int locals_cnt) {
   sub lambda = NULL;
   any *lambda_envp = NULL;
+  if(call_stack_pos + 1 == call_stack_allocated)
+    grow_call_stack();
+  // The entry must be complete before it becomes visible to the CPU profiler.
+  call_stack[call_stack_pos + 1].subr = subr;
+  call_stack[call_stack_pos + 1].args_pos = args_pos;
+  call_stack[call_stack_pos + 1].tail_calls = 0;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
   call_stack_pos++;
-  if(call_stack_pos == call_stack_allocated) {
-    call_stack_allocated *= 2;
-    call_stack = realloc(call_stack, call_stack_allocated * sizeof(*call_stack));
-  }
-  call_stack[call_stack_pos].subr = subr;
-  call_stack[call_stack_pos].args_pos = args_pos;
-  call_stack[call_stack_pos].tail_calls = 0;
+  if(call_hooks)
+    call_entered();
 start:;
   any *env = subr->env;
   any *ip = subr->code->ops;
-  while(1)
+  int prev_op = 0; // only for `count_op`
+  while(1) {
+    count_op(&prev_op, *ip);
     switch (*ip++) {
     case OP_CONST: last_value = *ip++; break;
     case OP_GET_ENV: last_value = env[*ip++]; break;
@@ -1614,17 +3918,23 @@ start:;
       drop_locals(locals_cnt);
       locals_cnt = the_call->locals_cnt;
       subr = the_call->to_be_called;
+      if(call_hooks)
+        call_leaving();
       call_stack[call_stack_pos].subr = subr;
       call_stack[call_stack_pos].args_pos = args_pos; // FIXME: stays unchanged?
       call_stack[call_stack_pos].tail_calls++;
+      if(call_hooks)
+        call_entered();
       goto start;
     }
     case OP_ADD_ARG:
       if(next_call()->nonrest_args_left) {
         next_call()->nonrest_args_left--;
         add_nonrest_arg();
-      } else
+      } else {
+        count_event(rest_arg_fallbacks);
         add_rest_arg();
+      }
       break;
     case OP_ADD_NONREST_ARG:
       next_call()->nonrest_args_left--;
@@ -1684,13 +3994,17 @@ start:;
       ip[-1] = OP_CONST;
       last_value = ip[0] = fdr(binding);
       ip++;
+      count_event(declared_patches);
       break;
     }
     default:
       eprintf("unknown vm instruction\n");
       abort(); // FIXME
     }
+  }
 cleanup:
+  if(call_hooks)
+    call_leaving();
   call_stack_pos--;
   drop_locals(locals_cnt);
 }
@@ -1751,7 +4065,198 @@ void call1(any s, any x) {
   call(subr, args_pos, locals_cnt);
 }
 
-void call2(any subr, any x, any y) { apply(subr, list2(x, y)); }
+void call2(any s, any x, any y) {
+  sub subr = any2sub(s);
+  sub_code sc = subr->code;
+  int locals_cnt = count_locals(sc);
+  size_t args_pos = alloc_locals(locals_cnt);
+  any *args = &locals_stack[args_pos];
+  if(sc->argc == 2) {
+    args[0] = x;
+    args[1] = y;
+    if(sc->take_rest)
+      args[2] = NIL;
+  }
+  else if(sc->argc == 1 && sc->take_rest) {
+    args[0] = x;
+    args[1] = single(y);
+  }
+  else if(sc->argc == 0 && sc->take_rest)
+    *args = list2(x, y);
+  else
+    args_error(sc, list2(x, y));
+  call(subr, args_pos, locals_cnt);
+}
+
+//////////////// profiling ////////////////
+
+// Samples are aggregated by call stack.  They are written as "folded
+// stacks" (frames from the outermost to the innermost one, separated
+// by `;`, followed by the weight), which flame graph tools accept.
+#define PROFILE_BUCKETS 1021
+#define PROFILE_MAX_DEPTH 256 // deeper stacks lose their outermost frames
+typedef struct stack_sample {
+  struct stack_sample *next;
+  uint64_t weight;
+  size_t depth;
+  sub_code frames[]; // NULL stands for omitted frames
+} *stack_sample;
+typedef struct profile { stack_sample buckets[PROFILE_BUCKETS]; } *profile;
+
+my profile profile_new() { return calloc(1, sizeof(struct profile)); }
+
+my void profile_free(profile p) {
+  for(int i = 0; i != PROFILE_BUCKETS; i++) {
+    stack_sample next;
+    for(stack_sample s = p->buckets[i]; s; s = next) {
+      next = s->next;
+      free(s);
+    }
+  }
+  free(p);
+}
+
+my size_t frames_hash(sub_code *frames, size_t depth) {
+  size_t res = 5381;
+  for(size_t i = 0; i != depth; i++)
+    res = res * 33 + ((uintptr_t)frames[i] >> 3);
+  return res;
+}
+
+my void profile_add(profile p, sub_code *frames, size_t depth, uint64_t weight) {
+  stack_sample *bucket = &p->buckets[frames_hash(frames, depth) % PROFILE_BUCKETS];
+  for(stack_sample s = *bucket; s; s = s->next)
+    if(s->depth == depth && !memcmp(s->frames, frames, depth * sizeof(sub_code))) {
+      s->weight += weight;
+      return;
+    }
+  stack_sample s = malloc(sizeof(struct stack_sample) + depth * sizeof(sub_code));
+  s->next = *bucket;
+  s->weight = weight;
+  s->depth = depth;
+  memcpy(s->frames, frames, depth * sizeof(sub_code));
+  *bucket = s;
+}
+
+my void profile_write(profile p, FILE *fp) {
+  for(int i = 0; i != PROFILE_BUCKETS; i++)
+    for(stack_sample s = p->buckets[i]; s; s = s->next) {
+      if(!s->depth)
+        fprintf(fp, "<toplevel>");
+      for(size_t j = 0; j != s->depth; j++) {
+        sub_code sc = s->frames[j];
+        fprintf(fp, "%s%s", j ? ";" : "", !sc ? "..." : is(sc->name) ? symtext(sc->name) : "<unknown>");
+      }
+      fprintf(fp, " %" PRIu64 "\n", s->weight);
+    }
+}
+
+// Store the code of the subs in `call_stack` (outermost first) in `frames`.
+my size_t current_frames(sub_code *frames) {
+  size_t depth = call_stack_pos, skip = 0;
+  if(depth > PROFILE_MAX_DEPTH) {
+    skip = depth - PROFILE_MAX_DEPTH + 1;
+    depth = PROFILE_MAX_DEPTH;
+  }
+  size_t i = 0;
+  if(skip)
+    frames[i++] = NULL;
+  for(size_t pos = 1 + skip; pos <= call_stack_pos; pos++)
+    frames[i++] = call_stack[pos].subr->code;
+  return depth;
+}
+
+my profile alloc_profile;
+my int64_t alloc_sample_interval;
+my sub_code alloc_frames[PROFILE_MAX_DEPTH];
+
+my void alloc_sample() {
+  uint64_t weight = alloc_sample_interval - alloc_sample_countdown; // the overshoot belongs to this sample
+  alloc_sample_countdown = alloc_sample_interval;
+  profile_add(alloc_profile, alloc_frames, current_frames(alloc_frames), weight);
+}
+
+void bone_alloc_profile_start(size_t sample_bytes) {
+  if(alloc_profile)
+    profile_free(alloc_profile);
+  alloc_profile = profile_new();
+  alloc_sample_interval = sample_bytes ? sample_bytes : 1;
+  alloc_sample_countdown = alloc_sample_interval;
+}
+
+void bone_alloc_profile_stop(FILE *fp) {
+  if(!alloc_profile)
+    return;
+  alloc_sample_countdown = INT64_MAX;
+  if(fp)
+    profile_write(alloc_profile, fp);
+  profile_free(alloc_profile);
+  alloc_profile = NULL;
+}
+
+// The CPU profiler samples the call stack from a SIGPROF handler.  As
+// it must not allocate there, samples are stored in a preallocated
+// buffer (each one as its depth followed by the frames) and only
+// aggregated when profiling stops.
+#define CPU_PROFILE_WORDS (1 << 22)
+my sub_code *cpu_samples;
+my size_t cpu_samples_used;
+my uint64_t cpu_samples_dropped;
+my struct sigaction old_sigprof_action;
+
+my void sigprof_handler(int sig) {
+  if(cpu_samples_used + 1 + PROFILE_MAX_DEPTH > CPU_PROFILE_WORDS) {
+    cpu_samples_dropped++;
+    return;
+  }
+  size_t depth = current_frames(&cpu_samples[cpu_samples_used + 1]);
+  cpu_samples[cpu_samples_used] = (sub_code)(uintptr_t)depth;
+  cpu_samples_used += 1 + depth;
+}
+
+my void set_profile_timer(int hz) {
+  struct itimerval t;
+  long usecs = hz ? 1000000 / hz : 0;
+  if(hz && !usecs)
+    usecs = 1;
+  t.it_interval.tv_sec = usecs / 1000000;
+  t.it_interval.tv_usec = usecs % 1000000;
+  t.it_value = t.it_interval;
+  if(setitimer(ITIMER_PROF, &t, NULL) == -1)
+    eprintf("WARNING: could not set the profiling timer: %s\n", strerror(errno));
+}
+
+void bone_profile_start(int samples_per_sec) {
+  if(cpu_samples)
+    bone_profile_stop(NULL);
+  cpu_samples = malloc(CPU_PROFILE_WORDS * sizeof(sub_code));
+  cpu_samples_used = 0;
+  cpu_samples_dropped = 0;
+  struct sigaction sa;
+  sa.sa_handler = sigprof_handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGPROF, &sa, &old_sigprof_action);
+  set_profile_timer(samples_per_sec > 0 ? samples_per_sec : 1);
+}
+
+void bone_profile_stop(FILE *fp) {
+  if(!cpu_samples)
+    return;
+  set_profile_timer(0);
+  sigaction(SIGPROF, &old_sigprof_action, NULL);
+  if(fp) {
+    profile p = profile_new();
+    for(size_t i = 0; i < cpu_samples_used; i += 1 + (uintptr_t)cpu_samples[i])
+      profile_add(p, &cpu_samples[i + 1], (uintptr_t)cpu_samples[i], 1);
+    profile_write(p, fp);
+    profile_free(p);
+  }
+  if(cpu_samples_dropped)
+    eprintf("WARNING: profiling buffer full, %" PRIu64 " samples were dropped\n", cpu_samples_dropped);
+  free(cpu_samples);
+  cpu_samples = NULL;
+}
 
 //////////////// compiler ////////////////
 
@@ -2334,16 +4839,63 @@ DEFSUB(fulldiv) {
 }
 DEFSUB(listp) { last_value = to_bool(is_cons(args[0]) || is_nil(args[0])); }
 DEFSUB(cat2) { last_value = cat2(args[0], args[1]); }
+my int dyn_reg_log;
+my void log_reg_size() {
+  any threshold = dynamic_vals[dyn_reg_log];
+  if(!is(threshold) || current_reg->bytes < (uint64_t)any2int(threshold))
+    return;
+  eprintf("REG: %" PRIu64 " bytes, %" PRIu64 " objects, %" PRIu64 " blocks in `in-reg` of ",
+          current_reg->bytes, current_reg->objects, current_reg->blocks);
+  sub caller = call_stack_pos > 1 ? call_stack[call_stack_pos - 1].subr : NULL; // the sub that used `in-reg`
+  if(!caller)
+    eprintf("<toplevel>");
+  else if(is(caller->code->name))
+    eprint(caller->code->name);
+  else
+    eprintf("<unknown>");
+  eprintf("\n");
+}
 DEFSUB(in_reg) {
+  if(tracing)
+    trace('B', "in-reg", NULL, NULL, 0);
   in_reg();
-  call0(args[0]);
+  call0_in_trace(args[0], "in-reg", NULL);
+  log_reg_size();
+  if(tracing)
+    trace('E', "in-reg", NULL, "bytes", current_reg->bytes);
   last_value = copy_back(last_value);
   end_in_reg();
 }
+DEFSUB(in_reg_return) { // the result must not refer to the inner region
+  if(tracing)
+    trace('B', "in-reg", NULL, NULL, 0);
+  in_reg();
+  call0_in_trace(args[0], "in-reg", NULL);
+  log_reg_size();
+  if(tracing)
+    trace('E', "in-reg", NULL, "bytes", current_reg->bytes);
+  end_in_reg();
+}
+DEFSUB(in_outer_reg) {
+  if(reg_pos == 0)
+    basic_error("no outer region available");
+  reg_push_outer();
+  bool failed = false;
+  try { // so that a `throw` will not free the outer region
+    call0(args[0]);
+  } catch {
+    failed = true;
+  }
+  reg_pop();
+  if(failed)
+    throw();
+}
 DEFSUB(bind) { bind(args[0], is(args[1]), args[2]); }
 DEFSUB(assoc_entry) { last_value = assoc_entry(args[0], args[1]); }
 DEFSUB(str_eql) { last_value = to_bool(str_eql(args[0], args[1])); }
 DEFSUB(str_neql) { last_value = to_bool(!str_eql(args[0], args[1])); }
+DEFSUB(str_ltp) { last_value = to_bool(str_cmp(args[0], args[1]) < 0); }
+DEFSUB(str_gtp) { last_value = to_bool(str_cmp(args[0], args[1]) > 0); }
 DEFSUB(list_star) { last_value = move_last_to_rest_x(args[0]); }
 DEFSUB(memberp) { last_value = to_bool(is_member(args[0], args[1])); }
 DEFSUB(reverse) { last_value = reverse(args[0]); }
@@ -2380,6 +4932,147 @@ DEFSUB(filter) {
   }
   last_value = lg.xs;
 }
+DEFSUB(fold) {
+  check(args[0], t_sub);
+  any res = args[1];
+  foreach(x, args[2]) {
+    call2(args[0], x, res);
+    res = last_value;
+  }
+  last_value = res;
+}
+DEFSUB(foldr) { // the elements are collected first, so long lists need no deep recursion
+  check(args[0], t_sub);
+  size_t n = len(args[2]), i = 0;
+  any *xs = malloc(n * sizeof(any) + 1);
+  foreach(x, args[2])
+    xs[i++] = x;
+  any res = args[1];
+  bool failed = false;
+  try {
+    while(i--) {
+      call2(args[0], xs[i], res);
+      res = last_value;
+    }
+  } catch {
+    failed = true;
+  }
+  free(xs);
+  if(failed)
+    throw();
+  last_value = res;
+}
+DEFSUB(unfold) {
+  listgen lg = listgen_new();
+  any seed = args[3];
+  while(1) {
+    call1(args[0], seed);
+    if(is(last_value))
+      break;
+    call1(args[1], seed);
+    listgen_add(&lg, last_value);
+    call1(args[2], seed);
+    seed = last_value;
+  }
+  last_value = lg.xs;
+}
+DEFSUB(nth_cons) {
+  any xs = args[1];
+  for(int64_t n = any2int(args[0]); n != 0; n--)
+    xs = cdr(xs);
+  last_value = xs;
+}
+DEFSUB(nth) {
+  CSUB_nth_cons(args);
+  last_value = car(last_value);
+}
+my any drop(int64_t n, any xs) {
+  for(; n != 0 && !is_nil(xs); n--)
+    xs = cdr(xs);
+  return xs;
+}
+my any take(int64_t n, any xs) {
+  listgen lg = listgen_new();
+  for(; n != 0 && !is_nil(xs); n--) {
+    listgen_add(&lg, car(xs));
+    xs = fdr(xs);
+  }
+  return lg.xs;
+}
+DEFSUB(drop) { last_value = drop(any2int(args[0]), args[1]); }
+DEFSUB(take) { last_value = take(any2int(args[0]), args[1]); }
+DEFSUB(dropr) {
+  int64_t cnt = len(args[1]) - any2int(args[0]);
+  last_value = cnt < 0 ? NIL : take(cnt, args[1]);
+}
+DEFSUB(taker) {
+  int64_t cnt = len(args[1]) - any2int(args[0]);
+  last_value = cnt < 0 ? args[1] : drop(cnt, args[1]);
+}
+DEFSUB(last) {
+  any xs = args[0];
+  while(is_cons(xs) && is_cons(fdr(xs)))
+    xs = fdr(xs);
+  last_value = car(xs);
+}
+DEFSUB(flatten) { // with our own stack of the lists we are inside of, instead of recursion
+  listgen lg = listgen_new();
+  size_t depth = 0, size = 16;
+  any *rests = malloc(size * sizeof(any));
+  any xs = args[0];
+  while(1) {
+    if(!is_cons(xs)) {
+      if(depth == 0)
+        break;
+      xs = rests[--depth];
+      continue;
+    }
+    any x = far(xs);
+    xs = fdr(xs);
+    if(is_cons(x)) {
+      if(depth == size)
+        rests = realloc(rests, (size *= 2) * sizeof(any));
+      rests[depth++] = xs;
+      xs = x;
+    } else if(!is_nil(x))
+      listgen_add(&lg, x);
+  }
+  free(rests);
+  last_value = lg.xs;
+}
+DEFSUB(findp) {
+  check(args[0], t_sub);
+  foreach(x, args[1]) {
+    call1(args[0], x);
+    if(is(last_value)) {
+      last_value = x;
+      return;
+    }
+  }
+  last_value = BFALSE;
+}
+DEFSUB(anyp) {
+  check(args[0], t_sub);
+  foreach(x, args[1]) {
+    call1(args[0], x);
+    if(is(last_value)) {
+      last_value = BTRUE;
+      return;
+    }
+  }
+  last_value = BFALSE;
+}
+DEFSUB(allp) {
+  check(args[0], t_sub);
+  foreach(x, args[1]) {
+    call1(args[0], x);
+    if(!is(last_value)) {
+      last_value = BFALSE;
+      return;
+    }
+  }
+  last_value = BTRUE;
+}
 DEFSUB(full_cat) {
   listgen lg = listgen_new();
   foreach_cons(c, args[0]) if(is_cons(c) && is_nil(fdr(c))) {
@@ -2409,22 +5102,208 @@ DEFSUB(with_var) {
 }
 DEFSUB(var_bound_p) { last_value = to_bool(is_dyn_bound(args[0])); }
 DEFSUB(var_bang) { set_dyn_val(args[0], args[1]); }
+my size_t reg_loop_state_size; // in bytes, of the last iteration
 DEFSUB(reg_loop) {
+  // We use two regions alternately: The state is copied from the one
+  // in use to the other one; then the first one is reset.
+  reg volatile other = reg_new();
   reg_push(reg_new());
-  call0(args[0]);
-
-  while(1) {
-    reg old = reg_pop();
-    reg_push(reg_new());
-    any sub_args = copy(last_value);
-    reg_free(old);
-    apply(args[1], sub_args);
-    if(!is(car(last_value)))
-      break;
-    last_value = fdr(last_value);
+  bool failed = false;
+  try {
+    call0(args[0]);
+    while(1) {
+      reg old = reg_pop();
+      reg_push(other);
+      any sub_args = copy(last_value);
+      reg_loop_state_size = current_reg->bytes;
+      reg_reset(old);
+      other = old;
+      apply(args[1], sub_args);
+      if(!is(car(last_value)))
+        break;
+      last_value = fdr(last_value);
+    }
+    last_value = copy_back(fdr(last_value));
+  } catch {
+    failed = true;
   }
-  last_value = copy_back(fdr(last_value));
   reg_free(reg_pop());
+  reg_free(other);
+  if(failed)
+    throw();
+}
+DEFSUB(reg_loop_state_size) { last_value = int2any(reg_loop_state_size); }
+DEFSUB(with_alloc_profiling) {
+  if(alloc_profile)
+    basic_error("allocation profiling is already active");
+  int64_t sample_bytes = any2int(args[1]);
+  if(sample_bytes <= 0)
+    generic_error("sample size must be positive", args[1]);
+  char *fname = str2charp(args[0]);
+  FILE *fp = fopen(fname, "w");
+  free(fname);
+  if(!fp)
+    generic_error("could not open", args[0]);
+
+  bool failed = false;
+  bone_alloc_profile_start(sample_bytes);
+  try {
+    call0(args[2]);
+  } catch {
+    failed = true;
+  }
+  bone_alloc_profile_stop(fp);
+  fclose(fp);
+  if(failed)
+    throw();
+}
+DEFSUB(with_profiling) {
+  if(cpu_samples)
+    basic_error("profiling is already active");
+  int64_t hz = any2int(args[1]);
+  if(hz <= 0)
+    generic_error("sample rate must be positive", args[1]);
+  char *fname = str2charp(args[0]);
+  FILE *fp = fopen(fname, "w");
+  free(fname);
+  if(!fp)
+    generic_error("could not open", args[0]);
+
+  bool failed = false;
+  bone_profile_start(hz);
+  try {
+    call0(args[2]);
+  } catch {
+    failed = true;
+  }
+  bone_profile_stop(fp);
+  fclose(fp);
+  if(failed)
+    throw();
+}
+DEFSUB(with_call_profiling) {
+  if(counting_calls)
+    basic_error("call profiling is already active");
+  start_counting_calls();
+  update_call_hooks();
+  bool failed = false;
+  size_t csp = call_stack_pos;
+  try {
+    call0(args[0]);
+  } catch {
+    failed = true;
+    // Count the calls cut short, but keep their entries for the backtrace.
+    size_t pos = call_stack_pos;
+    for(; call_stack_pos > csp; call_stack_pos--)
+      leave_call();
+    call_stack_pos = pos;
+  }
+  counting_calls = false;
+  update_call_hooks();
+  if(failed)
+    throw();
+}
+DEFSUB(profile_report) { print_call_profile(25); last_value = BTRUE; }
+DEFSUB(with_tracing) {
+  if(tracing)
+    basic_error("tracing is already active");
+  char *fname = str2charp(args[0]);
+  FILE *fp = fopen(fname, "w");
+  free(fname);
+  if(!fp)
+    generic_error("could not open", args[0]);
+
+  bool failed = false;
+  bone_trace_start();
+  try {
+    call0(args[1]);
+  } catch {
+    failed = true;
+  }
+  bone_trace_stop(fp);
+  fclose(fp);
+  if(failed)
+    throw();
+}
+DEFSUB(trace_subs) {
+  for(size_t i = 0; i != traced_subs_cnt; i++)
+    traced_subs[i]->traced = false;
+  traced_subs_cnt = 0;
+  foreach(name, args[0]) {
+    any binding = get_binding(name);
+    if(!is(binding) || !is_sub(fdr(binding)))
+      generic_error("not bound to a sub", name);
+    sub_code sc = any2sub(fdr(binding))->code;
+    traced_subs = realloc(traced_subs, (traced_subs_cnt + 1) * sizeof(sub_code));
+    traced_subs[traced_subs_cnt++] = sc;
+    sc->traced = true;
+  }
+  last_value = args[0];
+}
+#ifdef BONE_VM_STATS
+typedef struct { uint64_t cnt; int op, next; } op_stat;
+my int cmp_op_stats(const void *a, const void *b) {
+  uint64_t x = ((op_stat *)a)->cnt, y = ((op_stat *)b)->cnt;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+my void print_vm_stats() {
+  op_stat stats[OP_CNT * OP_CNT];
+  int n = 0;
+  uint64_t total = 0;
+  for(int op = 1; op != OP_CNT; op++)
+    if(op_cnts[op]) {
+      stats[n++] = (op_stat){ op_cnts[op], op, 0 };
+      total += op_cnts[op];
+    }
+  qsort(stats, n, sizeof(op_stat), cmp_op_stats);
+  bprintf("%14s %6s  %s\n", "count", "%", "instruction");
+  for(int i = 0; i != n; i++)
+    bprintf("%14" PRIu64 " %6.2f  %s\n", stats[i].cnt, 100.0 * stats[i].cnt / total, op_names[stats[i].op]);
+
+  n = 0;
+  for(int op = 0; op != OP_CNT; op++)
+    for(int next = 1; next != OP_CNT; next++)
+      if(op_pair_cnts[op][next])
+        stats[n++] = (op_stat){ op_pair_cnts[op][next], op, next };
+  qsort(stats, n, sizeof(op_stat), cmp_op_stats);
+  bprintf("\n%14s %6s  %s\n", "count", "%", "instruction pair");
+  for(int i = 0; i != n && i != 40; i++)
+    bprintf("%14" PRIu64 " %6.2f  %s %s\n", stats[i].cnt, 100.0 * stats[i].cnt / total,
+            op_names[stats[i].op], op_names[stats[i].next]);
+
+  bprintf("\n%14" PRIu64 "  ADD_ARG falling back to add_rest_arg()\n", rest_arg_fallbacks);
+  bprintf("%14" PRIu64 "  INSERT_DECLARED patching itself\n", declared_patches);
+}
+my void print_vm_stats_at_exit() {
+  dynamic_vals[dyn_dst] = get_dyn_val(intern("*stderr*"));
+  print_vm_stats();
+  dst_flush(cur_dst());
+}
+DEFSUB(vm_stats) { print_vm_stats(); last_value = BTRUE; }
+#else
+DEFSUB(vm_stats) { basic_error("vm-stats: not compiled with BONE_VM_STATS"); }
+#endif
+DEFSUB(mem_stats) {
+  bone_mem_stats ms;
+  bone_get_mem_stats(&ms);
+  listgen lg = listgen_new();
+#define x(name, val) listgen_add(&lg, list2(intern(name), int2any(val)))
+  x("bytes-allocated", ms.bytes_allocated);
+  x("objects-allocated", ms.objects_allocated);
+  x("bytes-copied", ms.bytes_copied);
+  x("blocks-in-use", ms.blocks_in_use);
+  x("free-blocks", ms.free_blocks);
+  x("block-size", blocksize);
+  x("mmap-calls", ms.mmap_calls);
+  x("permanent-bytes", ms.permanent_bytes);
+  x("sub-code-bytes", ms.sub_code_bytes);
+  x("sub-arena-bytes", ms.sub_arena_bytes);
+  x("reg-depth", reg_pos);
+  x("reg-bytes", current_reg->bytes);
+  x("reg-objects", current_reg->objects);
+  x("reg-blocks", current_reg->blocks);
+#undef x
+  last_value = lg.xs;
 }
 DEFSUB(err) {
   if(!silence_errors) {
@@ -2444,6 +5323,28 @@ DEFSUB(chr_read) {
   int c = nextc();
   last_value = c != -1 ? int2any(c) : ENDOFFILE;
 }
+DEFSUB(read_line) { last_value = read_line(); }
+DEFSUB(read_lines) {
+  listgen lg = listgen_new();
+  any line;
+  while((line = read_line()) != ENDOFFILE)
+    listgen_add(&lg, line);
+  last_value = lg.xs;
+}
+DEFSUB(each_line) {
+  check(args[0], t_sub);
+  while(1) {
+    in_reg(); // so that memory use does not grow with the number of lines
+    any line = read_line();
+    if(line == ENDOFFILE) {
+      end_in_reg();
+      break;
+    }
+    call1(args[0], line);
+    end_in_reg();
+  }
+  last_value = BTRUE;
+}
 DEFSUB(chr_look) {
   int c = look();
   last_value = c != -1 ? int2any(c) : ENDOFFILE;
@@ -2465,7 +5366,7 @@ DEFSUB(reload) {
   if(failed)
     throw();
 }
-DEFSUB(sort) { last_value = merge_sort(args[0], args[1]); }
+DEFSUB(sort) { last_value = sort(args[0], args[1]); }
 DEFSUB(num2str) { last_value = num2str(args[0]); }
 DEFSUB(sym2str) { last_value = sym2str(args[0]); }
 DEFSUB(src_line) { last_value = int2any(input_line(args[0])); }
@@ -2477,17 +5378,26 @@ DEFSUB(with_file_src) {
   free(fname);
   if(!fp)
     generic_error("could not open", args[0]);
+  const char *traced_file = tracing ? trace_name(args[0]) : NULL;
+  if(tracing)
+    trace('B', "with-file-src", traced_file, NULL, 0);
   any old = dynamic_vals[dyn_src];
-  dynamic_vals[dyn_src] = fp2src(fp, args[0]);
+  any src = fp2src(fp, args[0]);
+  dynamic_vals[dyn_src] = src;
 
   bool failed = false;
+  size_t csp = call_stack_pos;
   try {
     call0(args[1]);
   } catch {
     failed = true;
+    if(tracing)
+      trace_end_calls(csp);
   }
   dynamic_vals[dyn_src] = old;
-  fclose(fp);
+  bone_src_close(src);
+  if(tracing)
+    trace('E', "with-file-src", traced_file, NULL, 0);
   if(failed)
     throw();
 }
@@ -2498,17 +5408,55 @@ DEFSUB(with_file_dst) {
   free(fname);
   if(!fp)
     generic_error("could not open", args[0]);
+  const char *traced_file = tracing ? trace_name(args[0]) : NULL;
+  if(tracing)
+    trace('B', "with-file-dst", traced_file, NULL, 0);
   any old = dynamic_vals[dyn_dst];
-  dynamic_vals[dyn_dst] = fp2dst(fp, args[0]);
+  any dst = fp2dst(fp, args[0]);
+  dynamic_vals[dyn_dst] = dst;
 
   bool failed = false;
+  size_t csp = call_stack_pos;
   try {
     call0(args[1]);
   } catch {
     failed = true;
+    if(tracing)
+      trace_end_calls(csp);
   }
   dynamic_vals[dyn_dst] = old;
-  fclose(fp);
+  bone_dst_close(dst);
+  if(tracing)
+    trace('E', "with-file-dst", traced_file, NULL, 0);
+  if(failed)
+    throw();
+}
+
+DEFSUB(with_str_src) {
+  any old = dynamic_vals[dyn_src];
+  dynamic_vals[dyn_src] = str2src(args[0]);
+  bool failed = false;
+  try {
+    call0(args[1]);
+  } catch {
+    failed = true;
+  }
+  dynamic_vals[dyn_src] = old;
+  if(failed)
+    throw();
+}
+
+DEFSUB(with_str_dst) {
+  any old = dynamic_vals[dyn_dst], dst = str_dst();
+  dynamic_vals[dyn_dst] = dst;
+  bool failed = false;
+  try {
+    call0(args[0]);
+  } catch {
+    failed = true;
+  }
+  dynamic_vals[dyn_dst] = old;
+  last_value = str_dst_finish(dst);
   if(failed)
     throw();
 }
@@ -2517,18 +5465,195 @@ DEFSUB(eofp) { last_value = to_bool(args[0] == ENDOFFILE); }
 DEFSUB(srcp) { last_value = to_bool(tag_of(args[0]) == t_other && *((type_other_tag *)untag(args[0])) == t_other_src); }
 DEFSUB(dstp) { last_value = to_bool(tag_of(args[0]) == t_other && *((type_other_tag *)untag(args[0])) == t_other_dst); }
 
+DEFSUB(bytesp) { last_value = to_bool(tag_of(args[0]) == t_other && *((type_other_tag *)untag(args[0])) == t_other_bytes); }
+DEFSUB(bytes_len) { last_value = int2any(any2bytes(args[0])->len); }
+DEFSUB(bytes_slice) { last_value = bytes_slice(args[0], any2int(args[1]), any2int(args[2])); }
+DEFSUB(bytes_eqp) {
+  bytes a = any2bytes(args[0]), b = any2bytes(args[1]);
+  last_value = to_bool(a->len == b->len && (a->len == 0 || !memcmp(a->data, b->data, a->len)));
+}
+DEFSUB(bytes_plus) {
+  size_t n = 0;
+  foreach(x, args[0])
+    n += any2bytes(x)->len;
+  any res = bytes_new(n);
+  unsigned char *p = any2bytes(res)->data;
+  foreach(x, args[0]) {
+    bytes b = any2bytes(x);
+    if(b->len)
+      memcpy(p, b->data, b->len);
+    p += b->len;
+  }
+  last_value = res;
+}
+DEFSUB(list2bytes) {
+  any res = bytes_new(len(args[0]));
+  unsigned char *p = any2bytes(res)->data;
+  foreach(x, args[0]) {
+    int64_t n = any2int(x);
+    if(n < 0 || n > 255)
+      generic_error("not a byte", x);
+    *p++ = n;
+  }
+  last_value = res;
+}
+DEFSUB(bytes2list) {
+  bytes b = any2bytes(args[0]);
+  listgen lg = listgen_new();
+  for(size_t i = 0; i != b->len; i++)
+    listgen_add(&lg, int2any(b->data[i]));
+  last_value = lg.xs;
+}
+DEFSUB(str2bytes) {
+  size_t n = 0;
+  foreach(c, unstr(args[0]))
+    n += utf8_size(any2int(c));
+  any res = bytes_new(n);
+  char *p = (char *)any2bytes(res)->data;
+  foreach(c, unstr(args[0]))
+    utf8to_strp(any2int(c), &p);
+  last_value = res;
+}
+DEFSUB(bytes2str) {
+  bytes b = any2bytes(args[0]);
+  last_value = utf8_bytes2str(b->data, b->len);
+}
+DEFSUB(read_bytes) {
+  int64_t n = any2int(args[0]);
+  if(n < 0)
+    generic_error("cannot read a negative number of bytes", args[0]);
+  last_value = read_bytes(n);
+}
+DEFSUB(write_bytes) { write_bytes(args[0]); last_value = BTRUE; }
+DEFSUB(bytes_pack) { last_value = bytes_pack(args[0], args[1]); }
+DEFSUB(bytes_unpack) { last_value = bytes_unpack(args[0], args[1], any2int(args[2])); }
+
+DEFSUB(with_bytes_src) {
+  any old = dynamic_vals[dyn_src];
+  dynamic_vals[dyn_src] = bytes2src(args[0]);
+  bool failed = false;
+  try {
+    call0(args[1]);
+  } catch {
+    failed = true;
+  }
+  dynamic_vals[dyn_src] = old;
+  if(failed)
+    throw();
+}
+DEFSUB(with_bytes_dst) {
+  any old = dynamic_vals[dyn_dst], dst = str_dst();
+  dynamic_vals[dyn_dst] = dst;
+  bool failed = false;
+  try {
+    call0(args[0]);
+  } catch {
+    failed = true;
+  }
+  dynamic_vals[dyn_dst] = old;
+  last_value = bytes_dst_finish(dst);
+  if(failed)
+    throw();
+}
+DEFSUB(read_json) { last_value = read_json(); }
+DEFSUB(print_json) { print_json(args[0]); last_value = BTRUE; }
+DEFSUB(read_csv_row) { last_value = csv_read_row(csv_delim(args[0]), true); }
+DEFSUB(fold_csv_rows) {
+  // Like `reg-loop`: Each row is read and passed to the sub in a
+  // region that is reset afterwards.  Only the accumulated value is
+  // kept, by copying it alternately between two regions.
+  check(args[0], t_sub);
+  int delim = csv_delim(args[2]);
+  any header = is(args[3]) ? csv_read_header(delim) : BFALSE;
+  reg volatile acc_reg = reg_new(), other = reg_new();
+  reg row_reg = reg_new();
+  any volatile acc = args[1];
+  reg_push(row_reg);
+  bool failed = false;
+  try {
+    while(1) {
+      any row = csv_read_row(delim, true);
+      if(row == ENDOFFILE)
+        break;
+      if(is(header))
+        row = csv_row2alist(header, row);
+      call2(args[0], row, acc);
+      reg_push(other);
+      acc = copy(last_value);
+      reg_pop();
+      reg_pop();
+      reg_reset(row_reg);
+      reg_reset(acc_reg);
+      reg_push(row_reg);
+      reg tmp = acc_reg;
+      acc_reg = other;
+      other = tmp;
+    }
+  } catch {
+    failed = true;
+  }
+  reg_pop();
+  if(!failed)
+    last_value = copy(acc);
+  reg_free(row_reg);
+  reg_free(acc_reg);
+  reg_free(other);
+  if(failed)
+    throw();
+}
+DEFSUB(equalp) { last_value = to_bool(equal(args[0], args[1])); }
+DEFSUB(equal_hash) { last_value = int2any(equal_hash(args[0]) >> 5); } // fits into a fixnum
+DEFSUB(memo_cache) {
+  int64_t capacity = any2int(args[0]);
+  if(capacity < 1)
+    generic_error("invalid memo cache capacity", args[0]);
+  if(args[1] != intern("eq") && args[1] != intern("equal"))
+    generic_error("expected eq or equal", args[1]);
+  if(args[2] != intern("permanent") && args[2] != intern("reg"))
+    generic_error("expected permanent or reg", args[2]);
+  last_value = memo_new(capacity, args[1] == intern("equal"), args[2] == intern("permanent"));
+}
+DEFSUB(memo_call) { check(args[1], t_sub); last_value = memo_call(args[0], args[1], args[2]); }
+DEFSUB(memo_clear) {
+  memo m = any2memo(args[0]);
+  memo_clear_gen(m, &m->young);
+  memo_clear_gen(m, &m->old);
+  last_value = BTRUE;
+}
+DEFSUB(memo_stats) {
+  memo m = any2memo(args[0]);
+  listgen lg = listgen_new();
+#define x(name, val) listgen_add(&lg, list2(intern(name), int2any(val)))
+  x("hits", m->hits);
+  x("misses", m->misses);
+  x("evictions", m->evictions);
+  x("entries", m->young.count + m->old.count - m->old.moved);
+  x("capacity", m->capacity);
+#undef x
+  last_value = lg.xs;
+}
+DEFSUB(delay) { check(args[0], t_sub); last_value = promise_new(args[0], false); }
+DEFSUB(force) { last_value = force(args[0]); }
+DEFSUB(promisep) { last_value = to_bool(is_promise(args[0])); }
+DEFSUB(serialize) { serialize(args[0]); last_value = BTRUE; }
+DEFSUB(deserialize) { last_value = deserialize(); }
+
 DEFSUB(declare) { declare_binding(args[0]); }
 
 DEFSUB(protect) {
   bool old = silence_errors;
   silence_errors = true;
   size_t csp_backup = call_stack_pos;
+  size_t ncp_backup = next_call_pos; // calls whose args were being evaluated
+  size_t locals_backup = locals_pos;
   try {
     call0(args[0]);
   } catch {
     last_value = BFALSE;
+    next_call_pos = ncp_backup;
+    locals_pos = locals_backup;
   }
-  call_stack_pos = csp_backup;
+  unwind_call_stack(csp_backup);
   silence_errors = old;
 }
 
@@ -2604,10 +5729,14 @@ my void init_csubs() {
   bone_register_csub(CSUB_listp, "list?", 1, 0);
   bone_register_csub(CSUB_cat2, "_fast-cat", 2, 0);
   bone_register_csub(CSUB_in_reg, "_in-reg", 1, 0);
+  bone_register_csub(CSUB_in_reg_return, "_in-reg/return", 1, 0);
+  bone_register_csub(CSUB_in_outer_reg, "_in-outer-reg", 1, 0);
   bone_register_csub(CSUB_bind, "_bind", 3, 0);
   bone_register_csub(CSUB_assoc_entry, "assoc-entry?", 2, 0);
   bone_register_csub(CSUB_str_eql, "str=?", 2, 0);
   bone_register_csub(CSUB_str_neql, "str<>?", 2, 0);
+  bone_register_csub(CSUB_str_ltp, "str<?", 2, 0);
+  bone_register_csub(CSUB_str_gtp, "str>?", 2, 0);
   bone_register_csub(CSUB_list_star, "list*", 0, 1);
   bone_register_csub(CSUB_memberp, "member?", 2, 0);
   bone_register_csub(CSUB_reverse, "reverse", 1, 0);
@@ -2626,6 +5755,20 @@ my void init_csubs() {
   bone_register_csub(CSUB_gensym, "gensym", 0, 0);
   bone_register_csub(CSUB_map, "map", 2, 0);
   bone_register_csub(CSUB_filter, "filter", 2, 0);
+  bone_register_csub(CSUB_fold, "fold", 3, 0);
+  bone_register_csub(CSUB_foldr, "foldr", 3, 0);
+  bone_register_csub(CSUB_unfold, "unfold", 4, 0);
+  bone_register_csub(CSUB_nth_cons, "nth-cons", 2, 0);
+  bone_register_csub(CSUB_nth, "nth", 2, 0);
+  bone_register_csub(CSUB_drop, "drop", 2, 0);
+  bone_register_csub(CSUB_take, "take", 2, 0);
+  bone_register_csub(CSUB_dropr, "dropr", 2, 0);
+  bone_register_csub(CSUB_taker, "taker", 2, 0);
+  bone_register_csub(CSUB_last, "last", 1, 0);
+  bone_register_csub(CSUB_flatten, "flatten", 1, 0);
+  bone_register_csub(CSUB_findp, "find?", 2, 0);
+  bone_register_csub(CSUB_anyp, "any?", 2, 0);
+  bone_register_csub(CSUB_allp, "all?", 2, 0);
   bone_register_csub(CSUB_full_cat, "_full-cat", 0, 1);
   bone_register_csub(CSUB_refers_to, "_refers-to?", 2, 0);
   bone_register_csub(CSUB_load, "_load", 1, 0);
@@ -2634,11 +5777,53 @@ my void init_csubs() {
   bone_register_csub(CSUB_var_bound_p, "var-bound?", 1, 0);
   bone_register_csub(CSUB_var_bang, "_var!", 2, 0);
   bone_register_csub(CSUB_reg_loop, "_reg-loop", 2, 0);
+  bone_register_csub(CSUB_reg_loop_state_size, "reg-loop-state-size", 0, 0);
+  bone_register_csub(CSUB_mem_stats, "mem-stats", 0, 0);
+  bone_register_csub(CSUB_with_alloc_profiling, "_with-alloc-profiling", 3, 0);
+  bone_register_csub(CSUB_with_profiling, "_with-profiling", 3, 0);
+  bone_register_csub(CSUB_with_call_profiling, "_with-call-profiling", 1, 0);
+  bone_register_csub(CSUB_profile_report, "profile-report", 0, 0);
+  bone_register_csub(CSUB_vm_stats, "vm-stats", 0, 0);
+  bone_register_csub(CSUB_with_tracing, "_with-tracing", 2, 0);
+  bone_register_csub(CSUB_trace_subs, "trace-subs", 1, 0);
   bone_register_csub(CSUB_err, "err", 0, 1);
   bone_register_csub(CSUB_singlep, "single?", 1, 0);
   bone_register_csub(CSUB_read, "read", 0, 0);
   bone_register_csub(CSUB_chr_read, "chr-read", 0, 0);
   bone_register_csub(CSUB_chr_look, "chr-look", 0, 0);
+  bone_register_csub(CSUB_read_line, "read-line", 0, 0);
+  bone_register_csub(CSUB_read_lines, "read-lines", 0, 0);
+  bone_register_csub(CSUB_each_line, "each-line", 1, 0);
+  bone_register_csub(CSUB_bytesp, "bytes?", 1, 0);
+  bone_register_csub(CSUB_bytes_len, "bytes-len", 1, 0);
+  bone_register_csub(CSUB_bytes_slice, "bytes-slice", 3, 0);
+  bone_register_csub(CSUB_bytes_eqp, "bytes=?", 2, 0);
+  bone_register_csub(CSUB_bytes_plus, "bytes+", 0, 1);
+  bone_register_csub(CSUB_list2bytes, "list->bytes", 1, 0);
+  bone_register_csub(CSUB_bytes2list, "bytes->list", 1, 0);
+  bone_register_csub(CSUB_str2bytes, "str->bytes", 1, 0);
+  bone_register_csub(CSUB_bytes2str, "bytes->str", 1, 0);
+  bone_register_csub(CSUB_read_bytes, "read-bytes", 1, 0);
+  bone_register_csub(CSUB_write_bytes, "write-bytes", 1, 0);
+  bone_register_csub(CSUB_bytes_pack, "bytes-pack", 2, 0);
+  bone_register_csub(CSUB_bytes_unpack, "bytes-unpack", 3, 0);
+  bone_register_csub(CSUB_with_bytes_src, "_with-bytes-src", 2, 0);
+  bone_register_csub(CSUB_with_bytes_dst, "_with-bytes-dst", 1, 0);
+  bone_register_csub(CSUB_serialize, "serialize", 1, 0);
+  bone_register_csub(CSUB_deserialize, "deserialize", 0, 0);
+  bone_register_csub(CSUB_read_json, "read-json", 0, 0);
+  bone_register_csub(CSUB_print_json, "print-json", 1, 0);
+  bone_register_csub(CSUB_read_csv_row, "read-csv-row", 1, 0);
+  bone_register_csub(CSUB_equalp, "equal?", 2, 0);
+  bone_register_csub(CSUB_equal_hash, "equal-hash", 1, 0);
+  bone_register_csub(CSUB_delay, "_delay", 1, 0);
+  bone_register_csub(CSUB_memo_cache, "memo-cache", 3, 0);
+  bone_register_csub(CSUB_memo_call, "memo-call", 3, 0);
+  bone_register_csub(CSUB_memo_clear, "memo-clear", 1, 0);
+  bone_register_csub(CSUB_memo_stats, "memo-stats", 1, 0);
+  bone_register_csub(CSUB_force, "force", 1, 0);
+  bone_register_csub(CSUB_promisep, "promise?", 1, 0);
+  bone_register_csub(CSUB_fold_csv_rows, "fold-csv-rows", 4, 0);
   register_creader(CSUB_reader_t, "t");
   register_creader(CSUB_reader_f, "f");
   bone_register_csub(CSUB_reader_bind, "_reader-bind", 3, 0);
@@ -2651,6 +5836,8 @@ my void init_csubs() {
   bone_register_csub(CSUB_file_name, "file-name", 1, 0);
   bone_register_csub(CSUB_with_file_src, "_with-file-src", 2, 0);
   bone_register_csub(CSUB_with_file_dst, "_with-file-dst", 2, 0);
+  bone_register_csub(CSUB_with_str_src, "_with-str-src", 2, 0);
+  bone_register_csub(CSUB_with_str_dst, "_with-str-dst", 1, 0);
   bone_register_csub(CSUB_eofp, "eof?", 1, 0);
   bone_register_csub(CSUB_srcp, "src?", 1, 0);
   bone_register_csub(CSUB_dstp, "dst?", 1, 0);
@@ -2663,11 +5850,26 @@ my void init_csubs() {
 //////////////// misc ////////////////
 
 my any copy(any x) {
+  uint64_t before = mem_stats.bytes_allocated;
+  any res = copy_rec(x);
+  mem_stats.bytes_copied += mem_stats.bytes_allocated - before;
+  return res;
+}
+
+my any copy_rec(any x) {
   switch (tag_of(x)) {
-  case t_cons:
-    return cons(copy(far(x)), copy(fdr(x))); // FIXME: optimize
+  case t_cons: { // iterate over the cdrs, so long lists need no deep recursion
+    any res = single(copy_rec(far(x))), last = res;
+    for(x = fdr(x); is_cons(x); x = fdr(x)) {
+      any next = single(copy_rec(far(x)));
+      set_fdr(last, next);
+      last = next;
+    }
+    set_fdr(last, copy_rec(x));
+    return res;
+  }
   case t_str:
-    return str(copy(unstr(x)));
+    return str(copy_rec(unstr(x)));
   case t_sym:
   case t_num:
   case t_uniq:
@@ -2680,6 +5882,12 @@ my any copy(any x) {
       return copy_src(x);
     case t_other_dst:
       return copy_dst(x);
+    case t_other_bytes:
+      return copy_bytes(x);
+    case t_other_promise:
+      return copy_promise(x);
+    case t_other_memo:
+      return copy_memo(x);
     default:
       abort();
     }
@@ -2694,8 +5902,11 @@ my void bone_init_thread() {
   call_stack_pos = 0;
   call_stack->subr = NULL; // FIXME: dummy entry
   call_stack->tail_calls = 0;
-  locals_allocated = 256;
-  locals_stack = malloc(locals_allocated * sizeof(any));
+  call_stack->start_ns = 0;
+  locals_stack = mmap(NULL, LOCALS_MAX * sizeof(any), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(locals_stack == MAP_FAILED)
+    fail("could not reserve memory for the locals stack");
   locals_pos = 0;
   upcoming_calls_allocated = 64;
   upcoming_calls = malloc(upcoming_calls_allocated * sizeof(struct upcoming_call));
@@ -2724,6 +5935,9 @@ void bone_init(int argc, char **argv) {
 
   sub_allocp = NULL;
   sub_alloc_left = 0;
+#ifdef BONE_VM_STATS
+  atexit(print_vm_stats_at_exit);
+#endif
 
   sym_ht = hash_new(997, (any)NULL);
   init_syms();
@@ -2740,10 +5954,15 @@ void bone_init(int argc, char **argv) {
   create_dyn(intern("*stdin*"), in);
   create_dyn(intern("*stdout*"), out);
   create_dyn(intern("*stderr*"), fp2dst(stderr, charp2str("/dev/stderr")));
+  atexit(bone_flush_dsts);
   create_dyn(intern("*src*"), in);
   create_dyn(intern("*dst*"), out);
   dyn_src = any2int(get_dyn(intern("*src*")));
   dyn_dst = any2int(get_dyn(intern("*dst*")));
+  create_dyn(intern("*reg-log-threshold*"), BFALSE);
+  dyn_reg_log = any2int(get_dyn(intern("*reg-log-threshold*")));
+  create_dyn(intern("*json-str-keys*"), BFALSE);
+  dyn_json_str_keys = any2int(get_dyn(intern("*json-str-keys*")));
 
   create_dyn(intern("_*lisp-info*"), NIL);
   bone_info_entry("major-version", BONE_MAJOR);
@@ -2767,24 +5986,47 @@ my char *mod2file(const char *mod) {
 
 void bone_load(const char *mod) {
   char *fn = mod2file(mod);
-  FILE *src = fopen(fn, "r");
-  if(!src) {
+  FILE *fp = fopen(fn, "r");
+  if(!fp) {
     free(fn);
     generic_error("could not open module", intern(mod));
   }
+  const char *traced_mod = tracing ? symtext(intern(mod)) : NULL;
+  if(tracing)
+    trace('B', "load", traced_mod, NULL, 0);
   any old = dynamic_vals[dyn_src];
-  dynamic_vals[dyn_src] = fp2src(src, charp2str(fn));
+  any src = fp2src(fp, charp2str(fn));
+  dynamic_vals[dyn_src] = src;
   free(fn);
 
   bool fail = false;
+  const char *traced_step = NULL; // "read" or "eval" while they are traced
+  size_t csp = call_stack_pos;
   in_reg();
   try {
     if(look() == '#')
       skip_until('\n');
-    any e;
-    while((e = bone_read()) != ENDOFFILE)
+    while(1) {
+      if(tracing)
+        trace('B', traced_step = "read", NULL, NULL, 0);
+      any e = bone_read();
+      if(tracing)
+        trace('E', "read", NULL, NULL, 0);
+      traced_step = NULL;
+      if(e == ENDOFFILE)
+        break;
+      if(tracing)
+        trace('B', traced_step = "eval", NULL, NULL, 0);
       eval_toplevel_expr(e);
+      if(tracing)
+        trace('E', "eval", NULL, NULL, 0);
+      traced_step = NULL;
+    }
   } catch {
+    if(tracing && traced_step) {
+      trace_end_calls(csp);
+      trace('E', traced_step, NULL, NULL, 0);
+    }
     eprintf("-> failed to load before ");
     eprint(dynamic_vals[dyn_src]);
     eprintf("\n");
@@ -2792,8 +6034,10 @@ void bone_load(const char *mod) {
   }
   last_value = to_bool(!fail);
   end_in_reg();
-  fclose(src);
+  bone_src_close(src);
   dynamic_vals[dyn_src] = old;
+  if(tracing)
+    trace('E', "load", traced_mod, NULL, 0);
   if(fail)
     throw();
 }
@@ -2804,7 +6048,7 @@ void bone_repl() {
 
   int line = 0;
   while(1) {
-    printf("\n@%d: ", line++);
+    bprintf("\n@%d: ", line++);
     try {
       any e = bone_read();
       if(e == ENDOFFILE)
@@ -2814,8 +6058,10 @@ void bone_repl() {
       set_dyn_val(intern("$$"), get_dyn_val(intern("$")));
       set_dyn_val(intern("$"), last_value);
     } catch {
-      call_stack_pos = 0;
+      unwind_call_stack(0);
+      next_call_pos = 0;
+      locals_pos = 0;
     }
   }
-  printf("\n");
+  bprintf("\n");
 }
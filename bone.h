@@ -34,7 +34,7 @@
 typedef uint64_t any; // we only support 64 bit currently
 typedef void (*csub)(any *);
 typedef enum { t_cons = 0, t_sym = 1, t_uniq = 2, t_str = 3, /*t_unused = 4,*/ t_sub = 5, t_num = 6, t_other = 7 } type_tag;
-typedef enum { t_other_src, t_other_dst } type_other_tag;
+typedef enum { t_other_src, t_other_dst, t_other_bytes, t_other_promise, t_other_memo } type_other_tag;
 typedef enum { t_num_int, t_num_float } type_num_tag;
 #define BONE_INT_MIN -576460752303423488  /* -(2^59)  */
 #define BONE_INT_MAX  576460752303423487  /* 2^59 - 1 */
@@ -92,12 +92,17 @@ any charp2str(const char *p);
 char *str2charp(any x); // created w/ malloc()
 
 any intern(const char *name);
+any intern_n(const char *name, size_t len);
 char *symtext(any sym);
 
 any fp2src(FILE *fp, any name);
 any fp2dst(FILE *fp, any name);
+any str2src(any s);
 FILE *src2fp(any x);
 FILE *dst2fp(any x);
+bool bone_src_close(any x);
+bool bone_dst_close(any x);
+void bone_flush_dsts();
 
 jmp_buf *begin_try_();
 jmp_buf *throw_();
@@ -109,4 +114,23 @@ void end_try_();
 
 void bone_info_entry(const char *name, int n);
 
+typedef struct {
+  uint64_t bytes_allocated, objects_allocated; // in all regions since startup
+  uint64_t bytes_copied;                       // by `copy()`, also when copying back from regions
+  uint64_t blocks_in_use, free_blocks, mmap_calls;
+  uint64_t permanent_bytes;                    // allocated in the permanent region
+  uint64_t sub_code_bytes, sub_arena_bytes;    // used by/reserved for compiled code
+} bone_mem_stats;
+void bone_get_mem_stats(bone_mem_stats *stats);
+// Sample every `sample_bytes` allocated bytes; write folded stacks to `fp` when stopping.
+void bone_alloc_profile_start(size_t sample_bytes);
+void bone_alloc_profile_stop(FILE *fp);
+// Sample the call stack `samples_per_sec` times per second of CPU time;
+// write folded stacks to `fp` when stopping.
+void bone_profile_start(int samples_per_sec);
+void bone_profile_stop(FILE *fp);
+// Record events; write them in Chrome's trace event format to `fp` when stopping.
+void bone_trace_start();
+void bone_trace_stop(FILE *fp);
+
 #endif /* BONE_H */
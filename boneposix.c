@@ -164,6 +164,22 @@ DEFSUB(gettimeofday) {
   bone_result((res != -1) ? list2(int2any(tv.tv_sec), int2any(tv.tv_usec)) : BFALSE);
 }
 
+DEFSUB(clock_gettime) { // no CLOCK_REALTIME, as nanoseconds since the epoch don't fit in a fixnum
+  clockid_t clock;
+  if(args[0] == intern("monotonic")) clock = CLOCK_MONOTONIC;
+  else if(args[0] == intern("process-cputime")) clock = CLOCK_PROCESS_CPUTIME_ID;
+  else if(args[0] == intern("thread-cputime")) clock = CLOCK_THREAD_CPUTIME_ID;
+  else {
+    errno = EINVAL;
+    bone_result(BFALSE);
+    return;
+  }
+  struct timespec ts;
+  int res = clock_gettime(clock, &ts);
+  ses();
+  bone_result((res != -1) ? int2any((int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec) : BFALSE);
+}
+
 DEFSUB(mkdir) {
   char *d = str2charp(args[0]);
   int res = mkdir(d, any2int(args[1]));
@@ -258,6 +274,7 @@ DEFSUB(kill) {
 DEFSUB(exit) { exit(any2int(args[0])); }
 
 DEFSUB(fork) {
+  bone_flush_dsts(); // or the child would write out the same buffered output again
   int res = fork();
   ses();
   bone_result((res != -1) ? int2any(res) : BFALSE);
@@ -295,7 +312,7 @@ DEFSUB(src_open) {
 }
 
 DEFSUB(src_close) {
-  bool res = (fclose(src2fp(args[0])) == 0);
+  bool res = bone_src_close(args[0]);
   ses();
   bone_result(to_bool(res));
 }
@@ -309,7 +326,7 @@ DEFSUB(dst_open) {
 }
 
 DEFSUB(dst_close) {
-  bool res = (fclose(dst2fp(args[0])) == 0);
+  bool res = bone_dst_close(args[0]);
   ses();
   bone_result(to_bool(res));
 }
@@ -323,6 +340,7 @@ DEFSUB(execvp) {
   foreach(arg, args[1])
     argv[i++] = str2charp(arg);
   argv[i] = NULL;
+  bone_flush_dsts();
   execvp(prog, argv);
   ses();
   free(prog);
@@ -354,6 +372,7 @@ void bone_posix_init() {
   bone_register_csub(CSUB_getcwd, "sys.getcwd?", 0, 0);
   bone_register_csub(CSUB_time, "sys.time?", 0, 0);
   bone_register_csub(CSUB_gettimeofday, "sys.gettimeofday?", 0, 0);
+  bone_register_csub(CSUB_clock_gettime, "sys.clock-gettime?", 1, 0);
   bone_register_csub(CSUB_mkdir, "sys.mkdir?", 2, 0);
   bone_register_csub(CSUB_rmdir, "sys.rmdir?", 1, 0);
   bone_register_csub(CSUB_link, "sys.link?", 2, 0);
@@ -15,12 +15,93 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "bone.h"
 #include "boneposix.h"
 
+#define DEFAULT_ALLOC_SAMPLE_BYTES 4096
+#define DEFAULT_PROFILE_HZ 1000
+
+static FILE *alloc_profile_fp, *profile_fp, *trace_fp;
+static void write_profiles() {
+  if(alloc_profile_fp) {
+    bone_alloc_profile_stop(alloc_profile_fp);
+    fclose(alloc_profile_fp);
+  }
+  if(profile_fp) {
+    bone_profile_stop(profile_fp);
+    fclose(profile_fp);
+  }
+  if(trace_fp) {
+    bone_trace_stop(trace_fp);
+    fclose(trace_fp);
+  }
+}
+
+static FILE *open_profile(const char *fname) {
+  FILE *fp = fopen(fname, "w");
+  if(!fp) {
+    perror(fname);
+    exit(1);
+  }
+  return fp;
+}
+
+static const char *option_arg(const char *arg, const char *name) {
+  size_t len = strlen(name);
+  return strncmp(arg, name, len) == 0 && arg[len] == '=' ? arg + len + 1 : NULL;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: bone [--profile=FILE] [--profile-hz=N] [--trace=FILE]\n"
+                  "            [--alloc-profile=FILE] [--alloc-sample-bytes=N] [SCRIPT ARG...]\n");
+  exit(1);
+}
+
 int main(int argc, char **argv) {
+  const char *alloc_profile = NULL, *profile = NULL, *trace = NULL, *val;
+  long alloc_sample_bytes = DEFAULT_ALLOC_SAMPLE_BYTES, profile_hz = DEFAULT_PROFILE_HZ;
+  int opts = 1;
+  for(; opts < argc && strncmp(argv[opts], "--", 2) == 0; opts++) {
+    if((val = option_arg(argv[opts], "--profile")))
+      profile = val;
+    else if((val = option_arg(argv[opts], "--profile-hz"))) {
+      profile_hz = atol(val);
+      if(profile_hz <= 0)
+        usage();
+    }
+    else if((val = option_arg(argv[opts], "--trace")))
+      trace = val;
+    else if((val = option_arg(argv[opts], "--alloc-profile")))
+      alloc_profile = val;
+    else if((val = option_arg(argv[opts], "--alloc-sample-bytes"))) {
+      alloc_sample_bytes = atol(val);
+      if(alloc_sample_bytes <= 0)
+        usage();
+    }
+    else
+      usage();
+  }
+  argv[opts - 1] = argv[0]; // `*program-args*` should not contain our options
+  argc -= opts - 1;
+  argv += opts - 1;
+
   bone_init(argc, argv);
   bone_posix_init();
+  atexit(write_profiles);
+  if(alloc_profile) {
+    alloc_profile_fp = open_profile(alloc_profile);
+    bone_alloc_profile_start(alloc_sample_bytes);
+  }
+  if(profile) {
+    profile_fp = open_profile(profile);
+    bone_profile_start(profile_hz);
+  }
+  if(trace) {
+    trace_fp = open_profile(trace);
+    bone_trace_start();
+  }
   bone_load("prelude");
   bone_load("posixprelude");
   if (argc > 1) {
@@ -35,4 +116,3 @@ int main(int argc, char **argv) {
   bone_repl();
   return 0;
 }
-